@@ -0,0 +1,67 @@
+/*
+ *	Timing and reporting shared by the benchmarks. Results go to
+ *	standard output one per line as
+ *
+ *		name,count,seconds,rate
+ *
+ *	where rate is count per second, so a run can be diffed or fed to a
+ *	spreadsheet to spot regressions.
+ */
+
+#include <time.h>
+
+static FILE *bench_out;
+
+/* Scratch files live in a private directory made fresh for each run */
+#define BENCH_PATH	64
+static char bench_dir[BENCH_PATH];
+
+static char *bench_file(char *buf, const char *name)
+{
+  snprintf(buf, BENCH_PATH, "%s/%s", bench_dir, name);
+  return buf;
+}
+
+static void bench_end(void)
+{
+  rmdir(bench_dir);
+}
+
+static double bench_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_start(void)
+{
+  /* Keep the real output, the code under test writes to 1 */
+  bench_out = fdopen(dup(1), "w");
+  if (bench_out == NULL) {
+    perror("fdopen");
+    exit(1);
+  }
+  strcpy(bench_dir, "/tmp/benchXXXXXX");
+  if (mkdtemp(bench_dir) == NULL) {
+    perror("mkdtemp");
+    exit(1);
+  }
+  fprintf(bench_out, "name,count,seconds,rate\n");
+}
+
+static void bench_report(const char *name, unsigned long count, double secs)
+{
+  fprintf(bench_out, "%s,%lu,%.6f,%.0f\n", name, count, secs,
+    secs > 0 ? count / secs : 0.0);
+  fflush(bench_out);
+}
+
+/* Simple repeatable random numbers so every run draws the same thing */
+static uint32_t bench_seed = 1;
+
+static uint32_t bench_rand(void)
+{
+  bench_seed = bench_seed * 1103515245 + 12345;
+  return bench_seed >> 8;
+}
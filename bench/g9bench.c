@@ -0,0 +1,283 @@
+/*
+ *	Graphics benchmarks. This pulls in g9x.c whole, builds a synthetic
+ *	picture database and then times picture lookup, line drawing, flood
+ *	fill, whole and stepped picture rendering, display lists, the atlas
+ *	and the image writers.
+ */
+
+#define main g9x_main
+#include "../g9x.c"
+#undef main
+
+#include <string.h>
+#include "bench.h"
+#include "mkpics.h"
+
+static struct render *r;
+static uint8_t picbuf[8192];
+
+static void mk_db(void)
+{
+  pictures = picbuf;
+  picsize = mk_pictures(picbuf, NPICS, NSCENES);
+  gindex();
+}
+
+static void clear(void)
+{
+  render_clear(r);
+}
+
+static void bench_gfind(void)
+{
+  unsigned long n = 0;
+  uint32_t i;
+  uintptr_t x = 0;
+  double t = bench_now();
+
+  for (i = 0; i < 1000000; i++) {
+    x += (uintptr_t)gfind(0x100 + bench_rand() % NPICS);
+    n++;
+  }
+  bench_report("gfind", n, bench_now() - t);
+  if (x == 1)
+    write(2, "", 0);	/* Keep the lookups */
+}
+
+static void bench_line(void)
+{
+  unsigned long n = 0;
+  uint32_t i;
+  double t;
+
+  clear();
+  r->ink = 3;
+  r->option = 0;
+  t = bench_now();
+  for (i = 0; i < 200000; i++) {
+    line(r, bench_rand() % 160, bench_rand() % 128,
+         bench_rand() % 160, bench_rand() % 128);
+    n++;
+  }
+  bench_report("line", n, bench_now() - t);
+
+  /* Pictures are full of boxes and borders */
+  t = bench_now();
+  n = 0;
+  for (i = 0; i < 200000; i++) {
+    uint8_t a = bench_rand() % 160, b = bench_rand() % 128;
+    if (i & 1)
+      line(r, a, b, bench_rand() % 160, b);
+    else
+      line(r, a, b, a, bench_rand() % 128);
+    n++;
+  }
+  bench_report("line_hv", n, bench_now() - t);
+}
+
+static void bench_fill(void)
+{
+  unsigned long n = 0;
+  unsigned i;
+  double t = 0, t0;
+
+  for (i = 0; i < 200; i++) {
+    clear();
+    /* Split the screen up a bit so the fill has edges to follow */
+    r->ink = 3;
+    r->option = 0;
+    line(r, 0, 0, 159, 127);
+    line(r, 0, 127, 159, 0);
+    line(r, 80, 0, 80, 127);
+    t0 = bench_now();
+    fill(r, 20, 64, 1, 0);
+    fill(r, 150, 64, 2, 0);
+    t += bench_now() - t0;
+    n += 2;
+  }
+  bench_report("fill", n, t);
+}
+
+static void bench_draw(void)
+{
+  unsigned long n = 0;
+  unsigned i;
+  double t = bench_now();
+
+  for (i = 0; i < 2000; i++) {
+    clear();
+    draw_picture(r, 0x100 + i % NPICS);
+    n++;
+  }
+  bench_report("draw_picture", n, bench_now() - t);
+
+  /* Scenes built from the same sub-pictures in the same places */
+  t = bench_now();
+  n = 0;
+  for (i = 0; i < 2000; i++) {
+    clear();
+    draw_picture(r, 0x200 + i % NSCENES);
+    n++;
+  }
+  bench_report("draw_scene", n, bench_now() - t);
+
+  /* The same pictures a step at a time, as the co-process draws them */
+  t = bench_now();
+  n = 0;
+  for (i = 0; i < 2000; i++) {
+    clear();
+    draw_start(r, 0x100 + i % NPICS);
+    while (draw_step(r, 16))
+      ;
+    n++;
+  }
+  bench_report("draw_step_16", n, bench_now() - t);
+}
+
+/* The same pictures from display lists, at the display size and larger */
+static void bench_dlist(void)
+{
+  struct dlist *d[NPICS];
+  struct canvas c;
+  unsigned long n = 0;
+  unsigned i;
+  double t;
+
+  for (i = 0; i < NPICS; i++)
+    d[i] = dl_compile(r, 0x100 + i);
+  t = bench_now();
+  for (i = 0; i < 2000; i++) {
+    clear();
+    dl_replay(r, d[i % NPICS]);
+    n++;
+  }
+  bench_report("dl_replay", n, bench_now() - t);
+
+  memset(&c, 0, sizeof(c));
+  c.w = 640;
+  c.h = 512;
+  c.pix = malloc(640 * 512);
+  if (c.pix == NULL)
+    error("out of memory");
+  t = bench_now();
+  n = 0;
+  for (i = 0; i < 2000; i++) {
+    memset(c.pix, 0, 640 * 512);
+    dl_render(d[i % NPICS], &c);
+    n++;
+  }
+  bench_report("dl_render_640x512", n, bench_now() - t);
+  for (i = 0; i < NPICS; i++)
+    dl_free(d[i]);
+  free(c.pix);
+  free(c.stack);
+}
+
+/* The same pictures copied out of an atlas */
+static void bench_atlas(void)
+{
+  unsigned long n = 0;
+  unsigned i;
+  double t;
+  char path[BENCH_PATH];
+
+  atlas_build(bench_file(path, "pics.atlas"));
+  atlas_open(path);
+  unlink(path);
+  t = bench_now();
+  for (i = 0; i < 200000; i++) {
+    atlas_draw(r, 0x100 + i % NPICS);
+    n++;
+  }
+  bench_report("atlas_draw", n, bench_now() - t);
+}
+
+static void bench_ppm(void)
+{
+  unsigned long n = 0;
+  unsigned i;
+  FILE *o = fopen("/dev/null", "w");
+  double t;
+
+  if (o == NULL) {
+    perror("/dev/null");
+    exit(1);
+  }
+  clear();
+  draw_picture(r, 0x100);
+  t = bench_now();
+  for (i = 0; i < 200; i++) {
+    write_ppm(r, o);
+    n++;
+  }
+  fflush(o);
+  bench_report("write_ppm", n, bench_now() - t);
+
+  t = bench_now();
+  n = 0;
+  for (i = 0; i < 200; i++) {
+    write_raw(r, o);
+    n++;
+  }
+  fflush(o);
+  bench_report("write_raw", n, bench_now() - t);
+
+  /* 640x512 frames */
+  out_scale = 4;
+  t = bench_now();
+  n = 0;
+  for (i = 0; i < 200; i++) {
+    write_ppm(r, o);
+    n++;
+  }
+  fflush(o);
+  bench_report("write_ppm_x4", n, bench_now() - t);
+
+  t = bench_now();
+  n = 0;
+  for (i = 0; i < 200; i++) {
+    write_raw(r, o);
+    n++;
+  }
+  fflush(o);
+  bench_report("write_raw_x4", n, bench_now() - t);
+  out_scale = 1;
+
+  t = bench_now();
+  n = 0;
+  for (i = 0; i < 200; i++) {
+    write_sixel(r, o, 0);
+    n++;
+  }
+  fflush(o);
+  bench_report("write_sixel", n, bench_now() - t);
+
+  /* Updates as pictures change, most of each is the same scene */
+  t = bench_now();
+  n = 0;
+  for (i = 0; i < 200; i++) {
+    render_clear(r);
+    draw_picture(r, 0x200 + i % NSCENES);
+    write_sixel(r, o, 1);
+    n++;
+  }
+  fflush(o);
+  bench_report("sixel_update", n, bench_now() - t);
+  fclose(o);
+}
+
+int main(int argc, char *argv[])
+{
+  bench_start();
+  r = render_new();
+  mk_db();
+  bench_gfind();
+  bench_line();
+  bench_fill();
+  bench_draw();
+  bench_dlist();
+  bench_atlas();
+  bench_ppm();
+  bench_end();
+  return 0;
+}
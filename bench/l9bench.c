@@ -0,0 +1,235 @@
+/*
+ *	Interpreter benchmarks. This pulls in l9x.c whole so it can poke at
+ *	the internals, builds a synthetic game and then times the text
+ *	decompressor, dictionary matching, exit lookup, paging (when built
+ *	with VIRTUAL_GAME), whole scripted playthroughs (with and without
+ *	MSG_CACHE) and (with STATE_HASH) the whole state hash a turn's
+ *	running one saves.
+ */
+
+#define main l9x_main
+#include "../l9x.c"
+#undef main
+
+#include "bench.h"
+#include "mkgame.h"
+
+static char game_path[BENCH_PATH];
+static char image_path[BENCH_PATH];
+static char script_path[BENCH_PATH];
+
+static uint8_t gen[65536];
+static struct mkgame mg;
+
+static void reset(void)
+{
+  memset(&context, 0, sizeof(context));
+  stack = stackbase;
+  pc = pcbase;
+  game_over = 0;
+  quiet = 0;
+  wbp = 0;
+  xpos = 0;
+  state_rehash();
+#ifdef MSG_CACHE
+  mcache_flush();
+#endif
+}
+
+#ifdef GAME_IMAGE
+static void bench_decompress(const char *name)
+{
+  unsigned long chars = 0;
+  uint16_t m;
+  unsigned i;
+  double t;
+
+  dumpfd = open("/dev/null", O_WRONLY);
+  t = bench_now();
+  for (i = 0; i < 20; i++) {
+    for (m = 1; m <= mg.nmsg; m++) {
+      print_message(m);
+      chars += dlen;
+      dump_flush();
+    }
+  }
+  bench_report(name, chars, bench_now() - t);
+  close(dumpfd);
+  dumpfd = -1;
+}
+#endif
+
+static void bench_matchword(const char *name)
+{
+  static char *words[] = {
+    "NORTH", "e", "west", "lamp", "inventory", "xyzzy", "plugh", "door",
+    "climb", "down"
+  };
+  unsigned long n = 0;
+  unsigned i;
+  double t = bench_now();
+
+  for (i = 0; i < 200000; i++) {
+    matchword(words[i % 10]);
+    n++;
+  }
+  bench_report(name, n, bench_now() - t);
+}
+
+static void bench_exits(const char *name)
+{
+  unsigned long n = 0;
+  unsigned i;
+  double t = bench_now();
+
+  for (i = 0; i < 200000; i++) {
+    variables[0] = 1 + bench_rand() % 200;
+    variables[1] = 1 + (i & 3);
+    pc = pcbase + mg.exitop + 1;
+    lookup_exit();
+    n++;
+  }
+  bench_report(name, n, bench_now() - t);
+}
+
+#ifdef VIRTUAL_GAME
+static void bench_getb(void)
+{
+  unsigned long n = 0;
+  uint32_t i;
+  uint8_t x = 0;
+  double t;
+
+  t = bench_now();
+  for (i = 0; i < 4000000; i++) {
+    x += getb((uint8_t *)(uintptr_t)(i % mg.size));
+    n++;
+  }
+  bench_report("getb_sequential", n, bench_now() - t);
+
+  t = bench_now();
+  n = 0;
+  for (i = 0; i < 1000000; i++) {
+    x += getb((uint8_t *)(uintptr_t)(bench_rand() % mg.size));
+    n++;
+  }
+  bench_report("getb_random", n, bench_now() - t);
+  if (x == 0x55)
+    write(2, "", 0);	/* Keep the reads */
+}
+#endif
+
+static void bench_play(const char *name, unsigned n, uint8_t silent)
+{
+  unsigned long i0 = insns, t0 = turns;
+  double t;
+
+  mk_script(script_path, n);
+  reset();
+  replayfd = open_log(script_path, O_RDONLY);
+  replay_start();
+  if (!silent)
+    quiet = 0;
+  t = bench_now();
+  execute();
+  t = bench_now() - t;
+  bench_report(name, insns - i0, t);
+  {
+    char n[64];
+    snprintf(n, sizeof(n), "%s_turns", name);
+    bench_report(n, turns - t0, t);
+  }
+}
+
+#ifdef STATE_HASH
+static void bench_state(void)
+{
+  unsigned long n = 0;
+  uint64_t h = 0;
+  uint32_t i;
+  double t;
+
+  /* The playthrough leaves a lived in state, check it kept count */
+  if (state_hash != state_full()) {
+    fprintf(stderr, "state hash out of step\n");
+    exit(1);
+  }
+  t = bench_now();
+  for (i = 0; i < 100000; i++) {
+    setvar(i & 0xFF, i);
+    h += state_full();
+    n++;
+  }
+  bench_report("state_full", n, bench_now() - t);
+  if (h == 1)
+    write(2, "", 0);	/* Keep the hashes */
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+  int null = open("/dev/null", O_WRONLY);
+
+  bench_start();
+  bench_file(game_path, "game.dat");
+  bench_file(image_path, "game.l9i");
+  bench_file(script_path, "script.log");
+  /* Paged games can be bigger than the page cache */
+#ifdef VIRTUAL_GAME
+  mk_game(&mg, gen, 200, 600);
+#else
+  mk_game(&mg, gen, 200, 40);
+#endif
+  mk_write(&mg, game_path);
+  game_open(game_path);
+  game_setup();
+#ifdef VERIFY
+  verify();
+#endif
+  cols = 80;
+  seed = 1;
+#ifdef MSG_CACHE
+  mcache_init();
+#endif
+  /* The game output goes nowhere */
+  dup2(null, 1);
+
+#ifdef GAME_IMAGE
+  bench_decompress("decompress");
+#endif
+  bench_matchword("matchword");
+  bench_exits("lookup_exit");
+#ifdef VIRTUAL_GAME
+  bench_getb();
+#endif
+  bench_play("play", 2000, 0);
+  bench_play("replay", 2000, 1);
+#ifdef MSG_CACHE
+  /* The same without the message cache */
+  mcache_size = 0;
+  bench_play("play_nocache", 2000, 0);
+  mcache_size = MSG_CACHE_SIZE;
+#endif
+#ifdef STATE_HASH
+  bench_state();
+#endif
+
+#ifdef GAME_IMAGE
+  /* Now the same again with the indexes from an image */
+  image_write(image_path);
+  game_open(image_path);
+  game_setup();
+#ifdef VERIFY
+  verify();
+#endif
+  bench_decompress("decompress_image");
+  bench_matchword("matchword_image");
+  bench_exits("lookup_exit_image");
+  bench_play("play_image", 2000, 0);
+  unlink(image_path);
+#endif
+  unlink(game_path);
+  unlink(script_path);
+  bench_end();
+  return 0;
+}
@@ -0,0 +1,238 @@
+/*
+ *	Build a synthetic version 2 game so the benchmarks don't need any
+ *	real (copyright) game files. It is a ring of rooms with long
+ *	compressed descriptions, an input dictionary and an exit map, and
+ *	code that loops printing the room, reading a command and moving.
+ *
+ *	Tables and code come first as a table offset with the top bit set
+ *	means a list, so only the messages may sit above 32K.
+ *
+ *	Messages	1..rooms	room descriptions
+ *			rooms + 1	"You can't go that way."
+ *			rooms + 2	"Bye."
+ *			rooms + 3	"Turns: "
+ *			then padding messages to bulk the game out
+ *
+ *	Variables	0 location 1-4 words 5/6 exit flags/target
+ *			10 turns 11 constant 1
+ */
+
+struct mkgame {
+  uint8_t *g;
+  uint16_t size;
+  uint16_t code;	/* Start of code */
+  uint16_t exitop;	/* Offset in the code of the exit lookup */
+  uint16_t nmsg;
+};
+
+static const char *mk_words[] = {
+  "the ", "You are ", "room", " is ", "and ", "ancient ", "of ",
+  "passage", "walls ", "covered ", "in ", "writing", "dark", "light",
+  "north", "south", "east", "west", "There ", "a ", "to ", "you ",
+  "can ", "see ", "door", "stone", "with ", "from ", "into ", "old ",
+  NULL
+};
+
+/* A word starting with a top bit set byte ends the dictionary, so no
+   single letter words. Short input matches the first word it prefixes */
+static const char *mk_input[] = {
+  "NORTH", "SOUTH", "EAST", "WEST", "QUIT", "LOOK", "TAKE", "DROP", "OPEN",
+  "CLOSE", "LAMP", "DOOR", "KEY", "SWORD", "READ", "INVENTORY", "EXAMINE",
+  "CLIMB", "UP", "DOWN", NULL
+};
+
+static const uint8_t mk_value[] = {
+  1, 2, 3, 4, 100, 101, 20, 21, 22,
+  23, 40, 41, 42, 43, 24, 25, 26,
+  27, 5, 6
+};
+
+static uint16_t mk_pos;
+static uint8_t *mk_g;
+
+static void mk_b(uint8_t v)
+{
+  mk_g[mk_pos++] = v;
+}
+
+static void mk_w(uint16_t v)
+{
+  mk_b(v & 0xFF);
+  mk_b(v >> 8);
+}
+
+static void mk_hw(uint16_t off, uint16_t v)
+{
+  mk_g[off] = v & 0xFF;
+  mk_g[off + 1] = v >> 8;
+}
+
+/* Compress text using the word dictionary where we can */
+static void mk_text(const char *s)
+{
+  uint8_t i;
+  while(*s) {
+    for (i = 0; mk_words[i]; i++) {
+      size_t l = strlen(mk_words[i]);
+      if (strncmp(s, mk_words[i], l) == 0)
+        break;
+    }
+    if (mk_words[i]) {
+      mk_b(0x5E + i);
+      s += strlen(mk_words[i]);
+    } else if (*s == '\n') {
+      mk_b(0x25 - 0x1D);
+      s++;
+    } else
+      mk_b(*s++ - 0x1D);
+  }
+}
+
+static void mk_msg(const char *s, uint8_t packed)
+{
+  uint16_t st = mk_pos;
+  mk_b(0);
+  if (packed)
+    mk_text(s);
+  else
+    while(*s)
+      mk_b(*s++ - 0x1D);
+  mk_g[st] = mk_pos - st;
+}
+
+static void mk_game(struct mkgame *m, uint8_t *g, uint8_t rooms,
+                    uint16_t padding)
+{
+  char buf[200];
+  uint16_t i, j;
+  uint16_t loop, cantgo, quit, sub;
+  uint16_t fix_quit, fix_look, fix_cantgo, fix_loop1, fix_loop2, fix_sub;
+
+  mk_g = g;
+  mk_pos = 32;
+  memset(g, 0, 32);
+
+  /* Word dictionary, the header points one past the first length */
+  mk_hw(2, mk_pos + 1);
+  for (i = 0; mk_words[i]; i++)
+    mk_msg(mk_words[i], 0);
+
+  /* Table 1: input dictionary */
+  mk_hw(4 + 2, mk_pos);
+  for (i = 0; mk_input[i]; i++) {
+    size_t l = strlen(mk_input[i]);
+    for (j = 0; j < l; j++)
+      mk_b(mk_input[i][j] | (j == l - 1 ? 0x80 : 0));
+    mk_b(mk_value[i]);
+  }
+  mk_b(0x80);
+
+  /* Table 0: exits. East round the ring, west back, north home */
+  mk_hw(4, mk_pos);
+  for (i = 1; i <= rooms; i++) {
+    mk_b(0x10 | 3);	/* Bidirectional flag set for a bit of variety */
+    mk_b(i % rooms + 1);
+    mk_b(0x80 | 1);
+    mk_b(1);
+  }
+  mk_b(0);
+
+  /* Table 2: a list in lists[], table 3: constant data in the game */
+  mk_hw(4 + 4, 0x8000 | 16);
+  mk_hw(4 + 6, mk_pos);
+  for (i = 0; i < 256; i++)
+    mk_b(i * 3);
+
+  /* Code */
+  m->code = mk_pos;
+  mk_hw(4 + 22, mk_pos);
+#define PC	(mk_pos - m->code)
+  mk_b(0x48); mk_b(1); mk_b(0);		/* v0 = 1 */
+  mk_b(0x48); mk_b(0); mk_b(10);	/* v10 = 0 */
+  mk_b(0x48); mk_b(1); mk_b(11);	/* v11 = 1 */
+  loop = PC;
+  mk_b(0x04); mk_b(0);			/* print room */
+  mk_b(0x01); fix_sub = mk_pos; mk_w(0);
+  mk_b(0x07); mk_b(1); mk_b(2); mk_b(3); mk_b(4);
+  mk_b(0x0A); mk_b(11); mk_b(10);	/* turns++ */
+  mk_b(0x58); mk_b(1); mk_b(100); fix_quit = mk_pos; mk_w(0);
+  mk_b(0x58); mk_b(1); mk_b(101); fix_look = mk_pos; mk_w(0);
+  m->exitop = PC;
+  mk_b(0x0F); mk_b(0); mk_b(1); mk_b(5); mk_b(6);
+  mk_b(0x58); mk_b(6); mk_b(0); fix_cantgo = mk_pos; mk_w(0);
+  mk_b(0x09); mk_b(6); mk_b(0);		/* move */
+  mk_b(0xC1); mk_b(0); mk_b(0);		/* table2[0] = v0 */
+  mk_b(0x82); mk_b(5); mk_b(7);		/* v7 = table3[5] */
+  mk_b(0x00); fix_loop1 = mk_pos; mk_w(0);
+  cantgo = PC;
+  mk_b(0x45); mk_b(rooms + 1);
+  mk_b(0x00); fix_loop2 = mk_pos; mk_w(0);
+  quit = PC;
+  mk_b(0x45); mk_b(rooms + 3);
+  mk_b(0x03); mk_b(10);
+  mk_b(0x45); mk_b(rooms + 2);
+  mk_b(0x06); mk_b(1);
+  sub = PC;
+  mk_b(0x06); mk_b(2); mk_b(8);		/* v8 = random */
+  mk_b(0xA1); mk_b(0); mk_b(9);		/* v9 = table2[v0] */
+  mk_b(0x02);
+#undef PC
+
+  /* Messages go last as the padding can take the game over 32K */
+  mk_hw(0, mk_pos);
+  for (i = 1; i <= rooms; i++) {
+    snprintf(buf, sizeof(buf), "You are in the %s of ancient writing %u. "
+      "There is a door to the east and a passage to the north. The walls "
+      "are covered in old stone and you can see a light.\n",
+      (i & 1) ? "room" : "passage", i);
+    mk_msg(buf, 1);
+  }
+  mk_msg("You can't go that way.\n", 1);
+  mk_msg("Bye.\n", 1);
+  mk_msg("Turns: ", 1);
+  for (i = 0; i < padding; i++) {
+    snprintf(buf, sizeof(buf), "Message %u is here to make the table long "
+      "and the dark passage into the room of stone with you.\n", i);
+    mk_msg(buf, 1);
+  }
+  m->nmsg = rooms + 3 + padding;
+
+  mk_hw(fix_sub, sub);
+  mk_hw(fix_quit, quit);
+  mk_hw(fix_look, loop);
+  mk_hw(fix_cantgo, cantgo);
+  mk_hw(fix_loop1, loop);
+  mk_hw(fix_loop2, loop);
+  m->g = g;
+  m->size = mk_pos;
+}
+
+static void mk_write(struct mkgame *m, const char *name)
+{
+  int fd = open(name, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+  if (fd == -1 || write(fd, m->g, m->size) != m->size) {
+    perror(name);
+    exit(1);
+  }
+  close(fd);
+}
+
+/* A playthrough: wander the ring looking about, then quit */
+static void mk_script(const char *name, unsigned turns)
+{
+  static const char *cmd[] = {
+    "east\n", "look\n", "e\n", "take lamp\n", "north\n", "west\n",
+    "examine door\n", "w\n", "south\n", "e\n"
+  };
+  FILE *f = fopen(name, "w");
+  unsigned i;
+  if (f == NULL) {
+    perror(name);
+    exit(1);
+  }
+  fprintf(f, "#1\n");
+  for (i = 0; i < turns; i++)
+    fputs(cmd[i % 10], f);
+  fputs("quit\n", f);
+  fclose(f);
+}
@@ -0,0 +1,167 @@
+/*
+ *	Build a synthetic V2 picture database so the benchmarks and fuzz
+ *	harness don't need any real (copyright) picture files.
+ *
+ *	0		Common setup, sets the palette
+ *	1		A closed box drawn with short moves
+ *	2		A branching shape drawn with long moves
+ *	3		A tree made of shapes and boxes
+ *	0x100 + n	Pictures made of boxes, shapes, fills and reflections
+ *	0x200 + n	Scenes with rows of trees and no fills
+ */
+#define NPICS		48
+#define NSCENES		8
+
+static uint8_t *pp;
+static uint8_t *rec;
+
+static void pb(uint8_t v)
+{
+  *pp++ = v;
+}
+
+static void pic_start(uint16_t code)
+{
+  rec = pp;
+  pb(code >> 4);
+  pb((code & 0x0F) << 4);
+  pb(0);
+}
+
+/* Records are length prefixed, the length covers the header too */
+static void pic_end(void)
+{
+  uint16_t len;
+  pb(0xFF);
+  len = pp - rec;
+  rec[1] |= len >> 8;
+  rec[2] = len & 0xFF;
+}
+
+/* dx -4..3, dy -16..12 in steps of 4 */
+static void pic_short(uint8_t draw, int8_t dx, int8_t dy)
+{
+  uint8_t op = draw ? 0x00 : 0x40;
+  if (dx < 0) {
+    op |= 0x20;
+    dx += 4;
+  }
+  op |= dx << 3;
+  if (dy < 0) {
+    op |= 0x04;
+    dy += 16;
+  }
+  pb(op | (dy >> 2));
+}
+
+/* dx -32..31, dy -64..60 in steps of 4 */
+static void pic_long(uint8_t draw, int8_t dx, int8_t dy)
+{
+  uint16_t c = 0;
+  if (dx < 0) {
+    c |= 0x400;
+    dx += 32;
+  }
+  c |= dx << 5;
+  if (dy < 0) {
+    c |= 0x10;
+    dy += 64;
+  }
+  c |= dy >> 2;
+  pb(0xC0 | (draw ? 0x00 : 0x08) | (c >> 8));
+  pb(c & 0xFF);
+}
+
+/* Returns the size, buf wants 8K for NPICS and NSCENES */
+static uint32_t mk_pictures(uint8_t *buf, unsigned npics, unsigned nscenes)
+{
+  unsigned n, i;
+
+  pp = buf;
+
+  pic_start(0);
+  pb(0xF9); pb(0x00 | 0);
+  pb(0xF9); pb(0x08 | 2);
+  pb(0xF9); pb(0x10 | 4);
+  pb(0xF9); pb(0x18 | 7);
+  pic_end();
+
+  pic_start(1);
+  for (i = 0; i < 4; i++)
+    pic_short(1, 3, 0);
+  for (i = 0; i < 2; i++)
+    pic_short(1, 0, -12);
+  for (i = 0; i < 4; i++)
+    pic_short(1, -4, 0);
+  pic_short(1, 4, 0);
+  for (i = 0; i < 2; i++)
+    pic_short(1, 0, 12);
+  pic_end();
+
+  pic_start(2);
+  pic_long(1, 20, 40);
+  pic_long(1, 10, -24);
+  pic_long(0, -10, 24);
+  pic_long(1, -25, 8);
+  pic_long(1, 31, -64);
+  pic_long(0, -31, 60);
+  pic_long(1, 2, 60);
+  pic_end();
+
+  pic_start(3);
+  pb(0xE8); pb(2);
+  pb(0xF0 | 2);
+  pb(0xE8); pb(2);
+  pb(0xF0);
+  pb(0xD8 | 5);
+  pb(0x81);
+  pb(0x81);
+  pic_end();
+
+  for (n = 0; n < npics; n++) {
+    pic_start(0x100 + n);
+    /* A box filled in a colour */
+    pb(0xFB); pb(10 + n % 60); pb(40 + (n * 7) % 120);
+    pb(0xD8 | (4 + n % 3));
+    pb(0xD0 | (1 + n % 3));
+    pb(0x81);
+    pic_short(0, 2, 4);
+    pb(0xE0);
+    pb(0xD8);
+    /* Some larger shapes, reflected */
+    pb(0xFB); pb(80); pb(120);
+    for (i = 0; i < 4; i++) {
+      pb(0xF0 | i);
+      pb(0xD0 | (1 + (i + n) % 3));
+      pb(0xE8); pb(2);
+    }
+    pb(0xF0);
+    /* A sky that only paints the background */
+    pb(0xFC); pb(0x00);
+    pb(0xD0 | 2);
+    pb(0xFB); pb(2); pb(250);
+    pb(0xE2);
+    /* Then lines over the background only */
+    pb(0xFC); pb(0x01);
+    pb(0xD0 | 3);
+    pb(0xFB); pb(0); pb(4);
+    for (i = 0; i < 6; i++)
+      pic_long(1, 31, (i & 1) ? 28 : -28);
+    pb(0xFC); pb(0x00);
+    pic_end();
+  }
+  for (n = 0; n < nscenes; n++) {
+    pic_start(0x200 + n);
+    pb(0xFC); pb(0x00);
+    for (i = 0; i < 12; i++) {
+      pb(0xFB); pb(16 + (i % 4) * 40); pb(60 + (i / 4) * 70 + (n & 1) * 4);
+      pb(0xD0 | (1 + i % 3));
+      pb(0x83);
+    }
+    pic_end();
+  }
+  pb(0x80);
+  pb(0x80);
+  return pp - buf;
+}
+
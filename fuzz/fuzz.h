@@ -0,0 +1,221 @@
+/*
+ *	Driver shared by the fuzz harnesses. Each harness provides
+ *
+ *	fuzz_init()	One time set up, taking the snapshot of the loaded
+ *			state that each input starts from
+ *	fuzz_one()	Restore the snapshot and run one input to its budget
+ *	fuzz_seed()	Write a built in starting input
+ *
+ *	and this runs them under libFuzzer (build with -DLIBFUZZER and
+ *	-fsanitize=fuzzer), AFL++ persistent mode (build with afl-clang-fast)
+ *	or on its own as
+ *
+ *		harness file...			run each file once
+ *		harness -n runs [file...]	run that many random mutations
+ *						of the files (or the built in
+ *						input) and print the rate
+ *
+ *	where an input that crashes is first written to crash-pid.
+ */
+
+#include <signal.h>
+#include <time.h>
+
+#define FUZZ_MAX	65536
+
+static void fuzz_init(void);
+static void fuzz_one(const uint8_t *data, size_t len);
+static size_t fuzz_seed(uint8_t *buf);
+
+#if defined(LIBFUZZER)
+
+int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+  fuzz_init();
+  return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t len)
+{
+  fuzz_one(data, len);
+  return 0;
+}
+
+#elif defined(__AFL_FUZZ_TESTCASE_LEN)
+
+__AFL_FUZZ_INIT();
+
+int main(int argc, char *argv[])
+{
+  uint8_t *buf;
+
+  fuzz_init();
+  __AFL_INIT();
+  buf = __AFL_FUZZ_TESTCASE_BUF;
+  while (__AFL_LOOP(100000))
+    fuzz_one(buf, __AFL_FUZZ_TESTCASE_LEN);
+  return 0;
+}
+
+#else
+
+#ifdef __SANITIZE_ADDRESS__
+#include <sanitizer/asan_interface.h>
+#endif
+
+static uint8_t *fuzz_cur;	/* The input being run */
+static size_t fuzz_len;
+
+static void fuzz_crash(void)
+{
+  char name[32];
+  int fd;
+
+  snprintf(name, sizeof(name), "crash-%u", (unsigned)getpid());
+  fd = open(name, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if (fd != -1 && fuzz_cur) {
+    write(fd, fuzz_cur, fuzz_len);
+    close(fd);
+  }
+}
+
+static void fuzz_signal(int sig)
+{
+  fuzz_crash();
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+static size_t fuzz_load(const char *name, uint8_t *buf)
+{
+  int fd = open(name, O_RDONLY);
+  int l;
+
+  if (fd == -1 || (l = read(fd, buf, FUZZ_MAX)) < 0) {
+    perror(name);
+    exit(1);
+  }
+  close(fd);
+  return l;
+}
+
+/* Run a copy in a buffer poisoned all round it, so the sanitizers see
+   overruns either side without a fresh allocation for every input. It
+   starts on an 8 byte boundary as ASan can't poison part of one before */
+static void fuzz_run(const uint8_t *data, size_t len)
+{
+  static uint8_t *buf;
+  size_t off = (FUZZ_MAX - len) & ~(size_t)7;
+
+  if (buf == NULL && (buf = malloc(FUZZ_MAX)) == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  fuzz_cur = buf + off;
+  memcpy(fuzz_cur, data, len);
+  fuzz_len = len;
+#ifdef __SANITIZE_ADDRESS__
+  __asan_poison_memory_region(buf, off);
+  __asan_poison_memory_region(fuzz_cur + len, FUZZ_MAX - off - len);
+#endif
+  fuzz_one(fuzz_cur, len);
+#ifdef __SANITIZE_ADDRESS__
+  __asan_unpoison_memory_region(buf, FUZZ_MAX);
+#endif
+  fuzz_cur = NULL;
+}
+
+static uint32_t fuzz_rand(void)
+{
+  static uint32_t s = 1;
+  s ^= s << 13;
+  s ^= s >> 17;
+  s ^= s << 5;
+  return s;
+}
+
+/* A few random byte sets, bit flips and block copies */
+static size_t fuzz_mutate(uint8_t *p, size_t len)
+{
+  static const uint8_t magic[] = { 0x00, 0x01, 0x7F, 0x80, 0xFF };
+  uint8_t n = 1 + fuzz_rand() % 8;
+  size_t a, b, l;
+
+  if (len == 0)
+    return 0;
+  while (n--) {
+    a = fuzz_rand() % len;
+    switch(fuzz_rand() % 4) {
+      case 0:
+        p[a] = fuzz_rand();
+        break;
+      case 1:
+        p[a] ^= 1 << (fuzz_rand() % 8);
+        break;
+      case 2:
+        p[a] = magic[fuzz_rand() % sizeof(magic)];
+        break;
+      case 3:
+        b = fuzz_rand() % len;
+        l = 1 + fuzz_rand() % 16;
+        if (a + l <= len && b + l <= len)
+          memmove(p + a, p + b, l);
+        break;
+    }
+  }
+  /* Sometimes cut it short */
+  if (fuzz_rand() % 16 == 0)
+    len = fuzz_rand() % len;
+  return len;
+}
+
+int main(int argc, char *argv[])
+{
+  static uint8_t seeds[16][FUZZ_MAX];
+  static size_t seedlen[16];
+  static uint8_t buf[FUZZ_MAX];
+  unsigned long runs = 0, i;
+  int nseeds = 0;
+  size_t len;
+  double t;
+  struct timespec ts;
+
+  if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+    runs = strtoul(argv[2], NULL, 0);
+    argv += 2;
+    argc -= 2;
+  }
+  fuzz_init();
+#ifdef __SANITIZE_ADDRESS__
+  __sanitizer_set_death_callback(fuzz_crash);
+#endif
+  signal(SIGSEGV, fuzz_signal);
+  signal(SIGBUS, fuzz_signal);
+  signal(SIGABRT, fuzz_signal);
+
+  for (i = 1; i < argc && nseeds < 16; i++) {
+    seedlen[nseeds] = fuzz_load(argv[i], seeds[nseeds]);
+    if (runs == 0)
+      fuzz_run(seeds[nseeds], seedlen[nseeds]);
+    nseeds++;
+  }
+  if (runs == 0)
+    return 0;
+  if (nseeds == 0)
+    seedlen[nseeds++] = fuzz_seed(seeds[0]);
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  t = ts.tv_sec + ts.tv_nsec / 1e9;
+  for (i = 0; i < runs; i++) {
+    int s = fuzz_rand() % nseeds;
+    memcpy(buf, seeds[s], seedlen[s]);
+    len = fuzz_mutate(buf, seedlen[s]);
+    fuzz_run(buf, len);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  t = ts.tv_sec + ts.tv_nsec / 1e9 - t;
+  fprintf(stderr, "%lu runs in %.2fs, %.0f/s\n", runs, t, runs / t);
+  return 0;
+}
+
+#endif
@@ -0,0 +1,59 @@
+/*
+ *	Graphics fuzz harness. This pulls in g9x.c whole, built with FUZZ
+ *	so each picture stops when its budget runs out, and treats each
+ *	input as a picture file: it is indexed and the last picture in it
+ *	drawn on the display, then again through a display list onto a
+ *	larger canvas.
+ *
+ *	The render is made once and cleared between inputs, including the
+ *	sub-picture cache which would otherwise replay the last input.
+ */
+
+#define main g9x_main
+#include "../g9x.c"
+#undef main
+
+#include "fuzz.h"
+#include "../bench/mkpics.h"
+
+static struct render *r;
+static struct canvas cv;
+
+static void fuzz_init(void)
+{
+  r = render_new();
+  cv.w = 200;
+  cv.h = 160;
+  cv.pix = malloc(cv.w * cv.h);
+  if (cv.pix == NULL)
+    error("out of memory");
+}
+
+static void fuzz_one(const uint8_t *data, size_t len)
+{
+  struct dlist *d;
+  uint16_t code;
+
+  if (len > 0x7FFFFFFF)
+    return;
+  pictures = (uint8_t *)data;
+  picsize = len;
+  gindex();
+  if (npics == 0)
+    return;
+  /* The last picture, which in a real file calls on the others */
+  code = piclist[npics - 1];
+  gcache_flush(r);
+  render_clear(r);
+  draw_picture(r, code);
+  d = dl_compile(r, code);
+  memset(cv.pix, 0, cv.w * cv.h);
+  dl_render(d, &cv);
+  dl_free(d);
+}
+
+/* The shapes and a couple of pictures using them, small so it is quick */
+static size_t fuzz_seed(uint8_t *buf)
+{
+  return mk_pictures(buf, 2, 0);
+}
@@ -0,0 +1,157 @@
+/*
+ *	Interpreter fuzz harness. This pulls in l9x.c whole, built with FUZZ
+ *	so errors come back here, and treats each input as a game file: the
+ *	header is set up, the code verified and then run until it asks for
+ *	input (there is none) or the instruction budget runs out.
+ *
+ *	Everything a run changes is copied back from a snapshot taken after
+ *	start up, so inputs don't leak into each other and there is no new
+ *	process for each one. The big tables are left out of it: the game is
+ *	only ever the input (writes to it fault) so just the tail the last
+ *	input left behind is cleared, and the verifier clears what it uses.
+ */
+
+#define main l9x_main
+#include "../l9x.c"
+#undef main
+
+#include "fuzz.h"
+#include "../bench/mkgame.h"
+
+#define BUDGET		20000	/* Instructions an input */
+
+static struct {
+  void *p;
+  size_t len;
+  uint8_t *snap;
+} state[] = {
+  { &context, sizeof(context) },
+  { tables, sizeof(tables) },
+  { ttype, sizeof(ttype) },
+  { buffer, sizeof(buffer) },
+  { &stack, sizeof(stack) },
+  { &wbp, sizeof(wbp) },
+  { &xpos, sizeof(xpos) },
+  { &seed, sizeof(seed) },
+  { &quiet, sizeof(quiet) },
+  { &game_over, sizeof(game_over) },
+  { &word_depth, sizeof(word_depth) },
+#ifdef STATE_HASH
+  { &state_hash, sizeof(state_hash) },
+  { state_dirty, sizeof(state_dirty) },
+  { &state_changed, sizeof(state_changed) },
+#endif
+#ifdef VERIFY
+  { &stack_ok, sizeof(stack_ok) },
+  { lsafe, sizeof(lsafe) },
+  { maxoff, sizeof(maxoff) },
+  { &nroutines, sizeof(nroutines) },
+  { &ncalls, sizeof(ncalls) },
+#endif
+};
+
+#define NSTATE	(sizeof(state) / sizeof(state[0]))
+
+static size_t game_used;	/* Bytes of game_data the last input set */
+
+#ifdef STATE_HASH
+static uint16_t snap_vars[256];
+static uint8_t snap_lists[LISTSIZE];
+static uint64_t snap_hash;
+
+/* The same as state_full() but only mixing the slots that differ from
+   the snapshot, most of a run's state is never touched */
+static uint64_t fuzz_hash(void)
+{
+  uint64_t h = snap_hash;
+  uint64_t a, b;
+  uint16_t i, j;
+
+  for (i = 0; i < 256; i += 4) {
+    memcpy(&a, variables + i, 8);
+    memcpy(&b, snap_vars + i, 8);
+    if (a != b)
+      for (j = i; j < i + 4; j++)
+        h ^= state_mix(j, snap_vars[j]) ^ state_mix(j, variables[j]);
+  }
+  for (i = 0; i < LISTSIZE; i += 8) {
+    memcpy(&a, lists + i, 8);
+    memcpy(&b, snap_lists + i, 8);
+    if (a != b)
+      for (j = i; j < i + 8; j++)
+        h ^= state_mix(256 + j, snap_lists[j]) ^
+             state_mix(256 + j, lists[j]);
+  }
+  return h;
+}
+#endif
+
+static void fuzz_init(void)
+{
+  int null = open("/dev/null", O_RDWR);
+  unsigned i;
+
+  /* No input, and the output goes nowhere */
+  dup2(null, 0);
+  dup2(null, 1);
+  close(null);
+  cols = 80;
+  seed = 1;
+#ifdef MSG_CACHE
+  mcache_init();
+#endif
+  for (i = 0; i < NSTATE; i++) {
+    state[i].snap = malloc(state[i].len);
+    if (state[i].snap == NULL) {
+      perror("malloc");
+      exit(1);
+    }
+    memcpy(state[i].snap, state[i].p, state[i].len);
+  }
+#ifdef STATE_HASH
+  memcpy(snap_vars, variables, sizeof(snap_vars));
+  memcpy(snap_lists, lists, sizeof(snap_lists));
+  snap_hash = state_full();
+#endif
+}
+
+static void fuzz_one(const uint8_t *data, size_t len)
+{
+  unsigned i;
+
+#ifdef VERIFY
+  /* Only the routines found last time were marked */
+  memset(vstate, 0, nroutines * sizeof(vstate[0]));
+#endif
+  for (i = 0; i < NSTATE; i++)
+    memcpy(state[i].p, state[i].snap, state[i].len);
+  /* As game_open() would take it */
+  if (len < 32 || len > sizeof(game_data))
+    return;
+  memcpy(game_data, data, len);
+  if (len < game_used)
+    memset(game_data + len, 0, game_used - len);
+  game_used = len;
+  gamesize = len;
+  fuzz_budget = BUDGET;
+  if (setjmp(fuzz_jmp) == 0) {
+    game_setup();
+#ifdef VERIFY
+    verify();
+#endif
+    execute();
+  }
+#ifdef STATE_HASH
+  /* However the run ended the running hash must match the state */
+  if (state_hash != fuzz_hash())
+    abort();
+#endif
+}
+
+static size_t fuzz_seed(uint8_t *buf)
+{
+  struct mkgame m;
+
+  mk_game(&m, buf, 20, 0);
+  return m.size;
+}
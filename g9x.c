@@ -22,130 +22,494 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <string.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#endif
+#ifdef PROFILE
+#include <time.h>
+#endif
 
 /*
  *	Graphics driver for L9X
  *
- *	This will be forked from the main process and own the upper
- *	screen area. Right now it only understands V2 graphics format
- *	and also has no ideas about output, it just generates the four
- *	colour maps.
+ *	This is forked from the main process (g9x -p) and fed commands over
+ *	a pipe so the graphics run asynchronously to the game, or run by
+ *	hand to draw pictures into image files. Right now it only
+ *	understands V2 graphics format and its output is image files or
+ *	sixels.
  *
- *	When we've got the needed bits in place elsewhere we can then
- *	fork this off and send it messages over a pipe to manage the
- *	display. That also means we'll get the fancy behaviour of late
- *	games for free when the graphics ran asynchronously. We will need
- *	slightly more logic because we have to avoid getting further and
- *	further behind, and we also have to handshake with the main game
- *	when switching in and out of graphics mode, probably two pipes then!
+ *	Defines
+ *
+ *	PROFILE		:	Count and time what each picture does, giving
+ *			the -P report
+ *	FUZZ		:	Built into the fuzz harness: a whole picture
+ *			gets DRAW_ALL ops and stops when they run out
  */
 #define GFXSTACK_SIZE	64
 
-static char pictures[8192];
+static uint8_t *pictures;	/* Mapped from the picture file */
+static uint32_t picsize;
+static uint32_t picindex[0x800];	/* Record offset + 1 by code, 0 if none */
+static uint16_t piclist[0x800];	/* Codes in table order */
+static uint16_t npics;
 
-static uint8_t *gfxstack_base[GFXSTACK_SIZE];
-static uint8_t **gfxstack = gfxstack_base;
-static uint16_t gfxscale_base[GFXSTACK_SIZE];	/* Check if byte will do */
-static uint16_t *gfxscale = gfxscale_base;
+#define FILL_STACK	128
+#define FILL_COST	128	/* Rows a fill can cover */
+#ifdef FUZZ
+#define DRAW_ALL	256UL	/* A couple of fills, so the fuzzer keeps going */
+#else
+#define DRAW_ALL	(~0UL)
+#endif
+#define GCACHE_SIZE	256
+#define GCACHE_OPS	65536
+#define GREC_OPS	8192
+#define MAX_SCALE	4	/* -x */
 
-static const uint8_t scalemap[] = {
-  0x00, 0x02, 0x04, 0x06, 0x07, 0x09, 0x0c, 0x10
+/* A recorded masked write, see the sub-picture cache */
+struct gop {
+  uint16_t off;
+  uint8_t m;
+  uint8_t ob;
+  uint8_t pm;
+  uint8_t ink;
+};
+
+struct gcache {
+  /* Key */
+  uint16_t code;
+  uint16_t scale;
+  int16_t x, y;
+  uint8_t reflect, ink, option;
+  uint32_t gen;		/* Of the cache, an older one is empty */
+  /* State afterwards */
+  int16_t ex, ey;
+  uint8_t ereflect, eink, eoption;
+  /* Record */
+  uint32_t op;
+  uint16_t nops;
+};
+
+#ifdef PROFILE
+/* Opcode classes: short draw, move and call, the eight 0xC0 groups and
+   then the eight 0xF8 ops */
+#define PROF_OPS	18
+
+static const char *prof_opname[PROF_OPS] = {
+  "draw", "move", "call", "ldraw", "lmove", "ink", "scale", "fill",
+  "lcall", "reflect", "f8", "palette", "fa", "pos", "option", "pop",
+  "fe", "ret"
+};
+
+struct prof {
+  unsigned long ops[PROF_OPS];
+  unsigned long calls;
+  unsigned long cache_hits;
+  unsigned long depth;		/* Deepest sub-picture call */
+  unsigned long lines;
+  unsigned long line_pixels;
+  unsigned long fills;
+  unsigned long fill_pixels;
+  unsigned long fill_depth;	/* Most seeds pending at once */
+  unsigned long fill_rescans;
+  unsigned long gfinds;
+  unsigned long gfind_misses;
+  uint64_t line_ns;
+  uint64_t fill_ns;
+  uint64_t total_ns;
+};
+
+#define PROF(x)	x
+#else
+#define PROF(x)
+#endif
+
+/* A compiled picture, see the display list */
+struct dlop {
+  uint8_t op;
+  uint8_t a, b;
+  int16_t x0, y0, x1, y1;
+};
+
+struct dlist {
+  struct dlop *op;
+  uint16_t len;
+  uint16_t size;
+};
+
+/* An image at any resolution, a byte per pixel */
+struct canvas {
+  uint16_t w, h;
+  uint8_t palette[4];
+  uint8_t *pix;
+  uint8_t *out;		/* Image for the writers */
+  uint32_t *stack;	/* Fill seeds */
+  uint32_t stack_size;
 };
 
-static uint16_t scale;
-static uint8_t reflect;
-static uint8_t option;
-static uint8_t ink;
-static uint8_t palette[4];
-static int16_t draw_x, draw_y, new_x, new_y;
+/* Everything a render changes lives here so several can run at once. The
+   picture data is shared and read only */
+struct render {
+  uint8_t *gfxstack_base[GFXSTACK_SIZE];
+  uint8_t **gfxstack;
+  uint16_t gfxscale_base[GFXSTACK_SIZE];	/* Check if byte will do */
+  uint16_t *gfxscale;
+
+  uint16_t scale;
+  uint8_t reflect;
+  uint8_t option;
+  uint8_t ink;
+  uint8_t palette[4];
+  int16_t draw_x, draw_y, new_x, new_y;
+
+  uint8_t display[128 * 160 / 4];
+  /* Bytes written on each row since the last sixel update, lo > hi if
+     none, and what the terminal was last sent */
+  uint8_t dirty_lo[128];
+  uint8_t dirty_hi[128];
+  uint8_t shown[128 * 160 / 4];
+  uint8_t shown_palette[4];
+  uint8_t shown_ok;
+
+  /* Flood fill */
+  uint8_t fill_stack[FILL_STACK][2];
+  uint8_t fill_sp;
+  uint8_t fill_lost;
+  uint8_t fill_mark[128 * 160 / 8];	/* Pixels set by this fill */
+
+  /* Line test */
+  uint8_t line_ob;
+  uint8_t line_pm;
+  uint8_t line_ink;
+
+  /* Sub-picture cache, and the records in progress sharing one log */
+  struct gcache gcache[GCACHE_SIZE];
+  struct gop gcache_ops[GCACHE_OPS];
+  uint32_t gcache_top;
+  uint32_t gcache_gen;
+  struct gop grec_ops[GREC_OPS];
+  uint16_t grec_top;
+  struct {
+    struct gcache key;
+    uint16_t start;
+    uint8_t depth;
+  } grec[GFXSTACK_SIZE];
+  uint8_t nrec;
+
+  /* Image output */
+  uint8_t rgb_lut[256][12 * MAX_SCALE];
+  uint8_t idx_lut[256][4];
+  uint8_t lut_palette[4];
+  uint8_t lut_scale;
+  uint8_t image[32 + 160 * 128 * 3 * MAX_SCALE * MAX_SCALE];
+#ifdef PROFILE
+  struct prof prof;
+#endif
+  /* Set when compiling a picture rather than drawing it */
+  struct dlist *dl;
+  /* Set when drawing at another resolution */
+  struct canvas *cv;
+
+  /* The picture being drawn, see draw_start() */
+  uint8_t *gpc;		/* Where it carries on, NULL when done */
+  uint16_t gpic;	/* Drawn after the common setup */
+  uint8_t gsetup;	/* Still in the setup */
+  unsigned long budget;	/* Ops left in this step, a fill costs FILL_COST */
+  unsigned long step;	/* and what it started with */
+};
 
-static uint8_t display[128 * 160 / 4];
+static const uint8_t scalemap[] = {
+  0x00, 0x02, 0x04, 0x06, 0x07, 0x09, 0x0c, 0x10
+};
 
 /* The following routines will probably want to be in asm for any 8bit
    platform to provide sufficient speed */
 
-static void mayplot(uint8_t x, uint8_t y)
+static uint8_t peek(struct render *r, uint8_t x, uint8_t y)
 {
-  uint8_t *byte;
   uint8_t shift = (x & 3) << 1;
-  uint8_t b = 3 << shift;
-  uint8_t c = ink << shift;
-  uint8_t oc = option << shift;
+  uint8_t *byte = r->display + (y * 160 / 4) + (x >> 2);
+  if (x < 0 || x > 159 || y < 0 || y > 127)
+    return 255;
+  return (*byte >> shift) & 3;
+}
+
+static void damage(struct render *r, uint8_t y, uint8_t lo, uint8_t hi)
+{
+  if (lo < r->dirty_lo[y])
+    r->dirty_lo[y] = lo;
+  if (hi > r->dirty_hi[y])
+    r->dirty_hi[y] = hi;
+}
+
+static void damage_byte(struct render *r, uint8_t *byte)
+{
+  uint16_t off = byte - r->display;
+  damage(r, off / 40, off % 40, off % 40);
+}
+
+/* Flood fill the area of colour c2 around x,y with c. This is a scanline
+   fill: each seed grows into the longest run of old colour on its row,
+   stepping a byte at a time over bytes entirely of the old colour, the
+   run is filled in whole bytes where it can be and each run of old colour
+   touching it in the rows above and below becomes a new seed.
 
-  if (x < 0 || x > 160 || y < 0 || y > 127)
+   The seed stack is small and fixed. If it fills up we drop seeds but
+   remember every pixel we set, and once the stack drains sweep the screen
+   for filled pixels next to old colour to pick the lost work up again */
+
+#define pixel(row, x)	(((row)[(x) >> 2] >> (((x) & 3) << 1)) & 3)
+
+static void fill_push(struct render *r, uint8_t x, uint8_t y)
+{
+  if (r->fill_sp == FILL_STACK) {
+    r->fill_lost = 1;
     return;
+  }
+  r->fill_stack[r->fill_sp][0] = x;
+  r->fill_stack[r->fill_sp++][1] = y;
+  PROF(if (r->fill_sp > r->prof.fill_depth) r->prof.fill_depth = r->fill_sp);
+}
+
+/* Seed each run of old colour between xl and xr on row y */
+static void fill_seeds(struct render *r, uint8_t xl, uint8_t xr, uint8_t y, uint8_t ob)
+{
+  uint8_t *row = r->display + y * 40;
+  uint8_t x = xl;
+  uint8_t in = 0;
+  uint8_t b, t;
+
+  while (x <= xr) {
+    b = row[x >> 2];
+    if ((x & 3) == 0 && x + 3 <= xr) {
+      /* Whole bytes that are all old colour or have none in */
+      if (b == ob) {
+        if (!in)
+          fill_push(r, x, y);
+        in = 1;
+        x += 4;
+        continue;
+      }
+      t = b ^ ob;
+      if (!(~(t | (t >> 1)) & 0x55)) {
+        in = 0;
+        x += 4;
+        continue;
+      }
+    }
+    if (((b >> ((x & 3) << 1)) & 3) == (ob & 3)) {
+      if (!in)
+        fill_push(r, x, y);
+      in = 1;
+    } else
+      in = 0;
+    x++;
+  }
+}
+
+static void fill_span(struct render *r, uint8_t y, uint8_t xl, uint8_t xr, uint8_t c)
+{
+  uint8_t *row = r->display + y * 40;
+  uint8_t *mark = r->fill_mark + y * 20;
+  uint8_t x;
 
-  x >>= 2;
-  byte = display + (y * 160 / 4) + x;
-  if ((*byte & b) == oc) {
-    *byte &= ~b;
-    *byte |= c;
+  damage(r, y, xl >> 2, xr >> 2);
+  PROF(r->prof.fill_pixels += xr - xl + 1);
+  for (x = xl; x <= xr; x++) {
+    if ((x & 3) == 0 && x + 3 <= xr) {
+      row[x >> 2] = c * 0x55;
+      x += 3;
+    } else {
+      row[x >> 2] &= ~(3 << ((x & 3) << 1));
+      row[x >> 2] |= c << ((x & 3) << 1);
+    }
+  }
+  for (x = xl; x <= xr; x++) {
+    if ((x & 7) == 0 && x + 7 <= xr) {
+      mark[x >> 3] = 0xFF;
+      x += 7;
+    } else
+      mark[x >> 3] |= 1 << (x & 7);
   }
 }
 
-static void plot(uint8_t x, uint8_t y, uint8_t c)
+/* Find every filled pixel with an old colour neighbour */
+static void fill_rescan(struct render *r, uint8_t c2)
 {
-  uint8_t *byte;
-  uint8_t shift = (x & 3) << 1;
-  uint8_t b = 3 << shift;
-  
-  if (x < 0 || x > 160 || y < 0 || y > 127)
+  uint8_t x, y;
+  uint8_t *row;
+
+  for (y = 0; y < 128; y++) {
+    row = r->display + y * 40;
+    for (x = 0; x < 160; x++) {
+      if (!(r->fill_mark[y * 20 + (x >> 3)] & (1 << (x & 7))))
+        continue;
+      if (x > 0 && pixel(row, x - 1) == c2)
+        fill_push(r, x - 1, y);
+      if (x < 159 && pixel(row, x + 1) == c2)
+        fill_push(r, x + 1, y);
+      if (y > 0 && pixel(row - 40, x) == c2)
+        fill_push(r, x, y - 1);
+      if (y < 127 && pixel(row + 40, x) == c2)
+        fill_push(r, x, y + 1);
+    }
+  }
+}
+
+static void fill(struct render *r, uint8_t x, uint8_t y, uint8_t c, uint8_t c2)
+{
+  uint8_t ob = c2 * 0x55;
+  uint8_t xl, xr;
+  uint8_t *row;
+
+  /* c == c2 used to recurse until the stack ran out */
+  if (peek(r, x, y) != c2 || c == c2)
     return;
+  memset(r->fill_mark, 0, sizeof(r->fill_mark));
+  r->fill_sp = 0;
+  r->fill_lost = 0;
+  fill_push(r, x, y);
+
+  while (1) {
+    while (r->fill_sp) {
+      r->fill_sp--;
+      x = r->fill_stack[r->fill_sp][0];
+      y = r->fill_stack[r->fill_sp][1];
+      row = r->display + y * 40;
+      /* May have been filled since it was pushed */
+      if (pixel(row, x) != c2)
+        continue;
+      xl = x;
+      while (xl > 0 && pixel(row, xl - 1) == c2) {
+        if ((xl & 3) == 0 && xl >= 4 && row[(xl >> 2) - 1] == ob)
+          xl -= 4;
+        else
+          xl--;
+      }
+      xr = x;
+      while (xr < 159 && pixel(row, xr + 1) == c2) {
+        if ((xr & 3) == 3 && xr + 4 <= 159 && row[(xr >> 2) + 1] == ob)
+          xr += 4;
+        else
+          xr++;
+      }
+      fill_span(r, y, xl, xr, c);
+      if (y > 0)
+        fill_seeds(r, xl, xr, y - 1, ob);
+      if (y < 127)
+        fill_seeds(r, xl, xr, y + 1, ob);
+    }
+    if (!r->fill_lost)
+      break;
+    r->fill_lost = 0;
+    PROF(r->prof.fill_rescans++);
+    fill_rescan(r, c2);
+  }
+}
 
-  c <<= shift;;
+/* Lines that are wholly on screen skip mayplot() and walk a byte pointer
+   and pixel mask instead, doing all the pixels of a line that share a
+   byte at once (a whole byte at a time for flat lines). Each byte gets
+   mayplot()'s test done on all its pixels together: line_ob holds the
+   colour each pixel must be to be drawn over and line_pm the pixels that
+   can be drawn at all (mayplot() never draws the leftmost pixel of a byte
+   when the option top bit is set as the compare value shifts out of the
+   byte). Lines partly off screen are left to mayplot() as before */
 
-  x >>= 2;
+static void line_setup(struct render *r)
+{
+  uint8_t i, shift, oc;
 
-  byte = display + (y * 160 / 4) + x;
-  *byte &= ~b;
-  *byte |= c;
+  r->line_ob = 0;
+  r->line_pm = 0;
+  for (i = 0; i < 4; i++) {
+    shift = i << 1;
+    oc = r->option << shift;
+    if (oc & ~(3 << shift))
+      continue;
+    r->line_ob |= oc;
+    r->line_pm |= 3 << shift;
+  }
+  r->line_ink = r->ink * 0x55;
 }
 
-static uint8_t peek(uint8_t x, uint8_t y)
+static void gcache_op(struct render *r, uint8_t *byte, uint8_t m);
+
+static void mayplot_mask(struct render *r, uint8_t *byte, uint8_t m)
 {
-  uint8_t shift = (x & 3) << 1;
-  uint8_t *byte = display + (y * 160 / 4) + (x >> 2);
-  if (x < 0 || x > 159 || y < 0 || y > 127)
-    return 255;
-  return (*byte >> shift) & 3;
+  uint8_t t = *byte ^ r->line_ob;
+  uint8_t v;
+  if (r->nrec)
+    gcache_op(r, byte, m);
+  t = ~(t | (t >> 1)) & 0x55;
+  m &= (t | (t << 1)) & r->line_pm;
+  v = (*byte & ~m) | (r->line_ink & m);
+  if (v != *byte) {
+    damage_byte(r, byte);
+    *byte = v;
+  }
+}
+
+static void mayplot(struct render *r, uint8_t x, uint8_t y)
+{
+  /* x == 160 gets through and lands at the start of the next row, bar
+     the last row where it would be off the end of the display */
+  if (x > 160 || y > 127 || (x == 160 && y == 127))
+    return;
+  mayplot_mask(r, r->display + y * 40 + (x >> 2), 3 << ((x & 3) << 1));
+}
+
+static void line_row(struct render *r, int16_t x, int16_t x1, int16_t y)
+{
+  uint8_t *byte;
+  uint8_t l;
+
+  if (x < 0 || x1 > 159 || y < 0 || y > 127) {
+    for (; x <= x1; x++)
+      mayplot(r, x, y);
+    return;
+  }
+  byte = r->display + y * 40 + (x >> 2);
+  while (x <= x1) {
+    l = (x1 >= (x | 3)) ? 3 : x1 & 3;
+    mayplot_mask(r, byte++, (0xFF << ((x & 3) << 1)) & (0xFF >> ((3 - l) << 1)));
+    x = (x | 3) + 1;
+  }
 }
 
-/* Likewise this needs a proper byte filling algorithm with minimal recursion
-   or it'll be slow as molasses and eat the stack
-   
-   Basically you probably want to do
-   
-   if the byte we are on is entirely the precomputed old colour then set
-   it to the precomputed new colour and do a left and right sweep. When doing
-   the sweep add any byte above or below that is solid old colour unless you
-   saw solid old colour last byte above/below as you sweep.
-   
-   when you hit bytes left/right fill the end pixels doing a pixel by pixel
-   walk.
-   
-   During the pixel, and byte sweeps when you hit a byte that is not solid old,
-   or solid new then add each pixel that doesn't match to the stack
-   
-*/
-
-static void fill(uint8_t x, uint8_t y, uint8_t c, uint8_t c2)
-{
-  if (peek(x, y) != c2)
+static void line_column(struct render *r, int16_t x, int16_t y, int16_t y1)
+{
+  uint8_t *byte;
+  uint8_t m;
+
+  if (x < 0 || x > 159 || y < 0 || y1 > 127) {
+    for (; y <= y1; y++)
+      mayplot(r, x, y);
     return;
-  plot(x, y, c);
-  fill(x+1, y, c, c2);
-  fill(x-1, y, c, c2);
-  fill(x, y-1, c, c2);
-  fill(x, y+1, c, c2);
+  }
+  byte = r->display + y * 40 + (x >> 2);
+  m = 3 << ((x & 3) << 1);
+  for (; y <= y1; y++) {
+    mayplot_mask(r, byte, m);
+    byte += 40;
+  }
 }
 
-static void line(int16_t x, int16_t y, int16_t x1, int16_t y1)
+static void line(struct render *r, int16_t x, int16_t y, int16_t x1, int16_t y1)
 {
 	int8_t stepy = 0;
 	int8_t ydir = 1;
 	int16_t dx;
 	int16_t derr;
 	int16_t acc;
+	int16_t lo, hi;
+	uint8_t *byte;
+	uint8_t m;
 
 	/* Do we need to draw multiple pixels up or across ? */
 	if (abs(y1 - y) > abs(x1 - x)) {
@@ -168,6 +532,7 @@ static void line(int16_t x, int16_t y, int16_t x1, int16_t y1)
 	}
 
 	/* Work out our step and draw */
+	PROF(r->prof.line_pixels += x1 - x + 1);
 	derr = abs(y1 - y);
 	dx = x1 - x;
 	if (y1 < y) {
@@ -175,72 +540,482 @@ static void line(int16_t x, int16_t y, int16_t x1, int16_t y1)
 	}
 	acc = dx >> 1;
 
-	for (; x <= x1; x++) {
+	line_setup(r);
+	/* Straight across or down is one run */
+	if (derr == 0) {
 		if (stepy)
-			mayplot(y, x);	/* Inverted co-ords y is x x is y */
+			line_column(r, y, x, x1);
 		else
-			mayplot(x, y);
-		acc -= derr;
-		if (acc < 0) {
-			acc += dx;
-			y += ydir;
+			line_row(r, x, x1, y);
+		return;
+	}
+
+	lo = y < y1 ? y : y1;
+	hi = y < y1 ? y1 : y;
+	if (x < 0 || lo < 0 || x1 > (stepy ? 127 : 159) || hi > (stepy ? 159 : 127)) {
+		/* Partly off screen, leave it all to mayplot() */
+		for (; x <= x1; x++) {
+			if (stepy)
+				mayplot(r, y, x);	/* Inverted co-ords y is x x is y */
+			else
+				mayplot(r, x, y);
+			acc -= derr;
+			if (acc < 0) {
+				acc += dx;
+				y += ydir;
+			}
+		}
+		return;
+	}
+
+	if (stepy) {
+		/* One pixel a row, the mask moves when we step across */
+		byte = r->display + x * 40 + (y >> 2);
+		m = 3 << ((y & 3) << 1);
+		for (; x <= x1; x++) {
+			mayplot_mask(r, byte, m);
+			byte += 40;
+			acc -= derr;
+			if (acc < 0) {
+				acc += dx;
+				if (ydir > 0) {
+					m <<= 2;
+					if (m == 0) {
+						m = 0x03;
+						byte++;
+					}
+				} else {
+					m >>= 2;
+					if (m == 0) {
+						m = 0xC0;
+						byte--;
+					}
+				}
+			}
+		}
+	} else {
+		/* Gather the pixels that share a byte and do them together */
+		byte = r->display + y * 40 + (x >> 2);
+		m = 0;
+		for (; x <= x1; x++) {
+			m |= 3 << ((x & 3) << 1);
+			acc -= derr;
+			if (acc < 0 || (x & 3) == 3 || x == x1) {
+				mayplot_mask(r, byte, m);
+				m = 0;
+				if ((x & 3) == 3)
+					byte++;
+				if (acc < 0) {
+					acc += dx;
+					byte += ydir * 40;
+				}
+			}
 		}
 	}
 }
 
+#ifdef PROFILE
+#define USAGE_PROF	"\n     g9x -P picturefile"
+#else
+#define USAGE_PROF	""
+#endif
+#define USAGE	"g9x: [-a atlas] [-f ppm|raw|sixel] [-R WxH | -x scale] [-o file] picturefile number\n" \
+		"     g9x -b [-a atlas] [-j threads] [-f ppm|raw|sixel] [-R WxH | -x scale] [-o dir] picturefile [first [last]]\n" \
+		"     g9x -p [-a atlas] [-f ppm|raw|sixel] [-R WxH | -x scale] [-o file] picturefile\n" \
+		"     g9x -A atlas picturefile\n" \
+		"     g9x -l picturefile" USAGE_PROF
+
 static void error(const char *p)
 {
   fprintf(stderr, "%s\n", p);
   exit(1);
 }
 
-static void fill_current(uint8_t i)
+/* Bad picture data, which the fuzz harness sees plenty of */
+#ifdef FUZZ
+#define gwarn(p)	do { } while(0)
+#else
+#define gwarn(p)	fprintf(stderr, "%s\n", (p))
+#endif
+
+/*
+ *	Display lists. Running a picture with r->dl set draws nothing and
+ *	instead records each line, fill and palette change with the state it
+ *	was done in and its coordinates in the full internal precision, so
+ *	the sub-picture calls, scale stack and reflection are all gone and
+ *	the list can be drawn again at any resolution. Lines carry their
+ *	ink and option.
+ */
+
+#define DL_LINE		0	/* a ink b option, x0,y0 to x1,y1 */
+#define DL_FILL		1	/* a colour b colour to fill over, at x0,y0 */
+#define DL_PALETTE	2	/* a entry b colour */
+#define DL_MAX		32768
+
+static void dl_add(struct dlist *d, uint8_t op, uint8_t a, uint8_t b,
+  int16_t x0, int16_t y0, int16_t x1, int16_t y1)
+{
+  struct dlop *o;
+
+  if (d->len == d->size) {
+    /* A runaway picture just gets cut short */
+    if (d->size == DL_MAX)
+      return;
+    d->size = d->size ? d->size * 2 : 256;
+    d->op = realloc(d->op, d->size * sizeof(struct dlop));
+    if (d->op == NULL)
+      error("out of memory");
+  }
+  o = d->op + d->len++;
+  o->op = op;
+  o->a = a;
+  o->b = b;
+  o->x0 = x0;
+  o->y0 = y0;
+  o->x1 = x1;
+  o->y1 = y1;
+}
+
+#ifdef PROFILE
+static uint64_t prof_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+static void fill_current(struct render *r, uint8_t i)
 {
   uint8_t m = i & 3;
+  PROF(uint64_t t = prof_now());
   if (m == 0)
-    m = ink;
-  fill(draw_x >> 6 , 127 - (draw_y >> 7), m, option & 3);
+    m = r->ink;
+  if (r->dl)
+    dl_add(r->dl, DL_FILL, m, r->option & 3, r->draw_x, r->draw_y, 0, 0);
+  else
+    fill(r, r->draw_x >> 6 , 127 - (r->draw_y >> 7), m, r->option & 3);
+  PROF(r->prof.fills++);
+  PROF(r->prof.fill_ns += prof_now() - t);
+}
+
+static void draw_line(struct render *r)
+{
+  PROF(uint64_t t = prof_now());
+  if (r->dl)
+    dl_add(r->dl, DL_LINE, r->ink, r->option, r->draw_x, r->draw_y,
+      r->new_x, r->new_y);
+  else
+    line(r, r->draw_x >> 6, 127 - (r->draw_y >> 7), r->new_x >> 6, 127 - (r->new_y >> 7));
+  PROF(r->prof.lines++);
+  PROF(r->prof.line_ns += prof_now() - t);
 }
 
-static void draw_line(void)
+/* Pictures are packed records of a 12bit code, a 12bit length and the
+   drawing ops. Codes with the top bit set end the table so only the
+   first 0x800 can be found. Index them all once at load, keeping the
+   first record for each code as a walk of the table would find */
+static void gindex(void)
 {
-  line(draw_x >> 6, 127 - (draw_y >> 7), new_x >> 6, 127 - (new_y >> 7));
+  uint32_t o = 0;
+  uint16_t code, len;
+
+  memset(picindex, 0, sizeof(picindex));
+  npics = 0;
+  while (o + 3 <= picsize && !(pictures[o] & 0x80)) {
+    code = (pictures[o] << 4) | (pictures[o + 1] >> 4);
+    len = ((pictures[o + 1] & 0x0F) << 8) | pictures[o + 2];
+    if (picindex[code] == 0) {
+      picindex[code] = o + 1;
+      piclist[npics++] = code;
+    }
+    /* A bad length would walk backwards or stand still */
+    if (len < 3)
+      break;
+    o += len;
+  }
 }
 
 static uint8_t *gfind(uint16_t code)
-{	
-  uint8_t *p = pictures;
-  uint8_t h = code >> 4;
-  uint8_t l = (code & 0x0F) << 4;
-  
-  while(1) {
-    /* Top 8bits of code */
-    uint8_t c = *p++;
-    /* Next 4 bits of code, then 4 high bits of length */
-    uint8_t cl = *p++;
-    /* Check for end mark */
-    if (c & 0x80)
-      return NULL;
-    if (c == h) {
-      if ((cl & 0xF0) == l)
-        return p + 1;
+{
+  uint32_t o;
+
+  code &= 0xFFF;
+  if (code >= 0x800 || (o = picindex[code]) == 0)
+    return NULL;
+  /* Skip the 3 byte header */
+  return pictures + o + 2;
+}
+
+/*
+ *	Sub-picture cache. Scenes call the same sub-pictures over and over
+ *	from the same place, so the first time a sub-picture is drawn with a
+ *	given code, scale, reflect, ink, option and origin we record what it
+ *	did to the display and after that play the record back instead.
+ *
+ *	Drawing over the display depends on what is already there (lines
+ *	only paint over the option colour) so the record is the list of
+ *	masked byte writes with their conditions rather than the changed
+ *	bytes, and plays back right over any background. Fills depend on the
+ *	shape of what is there as well so a sub-picture that fills is never
+ *	cached, and neither is one that changes the palette or the scale
+ *	stack its caller sees. Records nest, a sub-picture called while
+ *	recording another gets a record of its own too.
+ */
+
+/* The state a sub-picture call starts from */
+static void gcache_key(struct render *r, struct gcache *k, uint16_t code)
+{
+  k->code = code;
+  k->scale = r->scale;
+  k->x = r->draw_x;
+  k->y = r->draw_y;
+  k->reflect = r->reflect;
+  k->ink = r->ink;
+  k->option = r->option;
+  k->gen = r->gcache_gen;
+}
+
+static struct gcache *gcache_slot(struct render *r, struct gcache *k)
+{
+  /* Positions tend to be multiples of 0x40 so mix the bits about */
+  uint32_t h = k->code * 0x9E3779B1UL;
+  h ^= (uint16_t)k->x * 0x85EBCA77UL;
+  h ^= (uint16_t)k->y * 0xC2B2AE3DUL;
+  h ^= (k->scale | (k->reflect << 8) | (k->ink << 10) |
+    ((uint32_t)k->option << 12)) * 0x27D4EB2FUL;
+  return r->gcache + (h >> 16) % GCACHE_SIZE;
+}
+
+static uint8_t gcache_match(struct gcache *c, struct gcache *k)
+{
+  return c->gen == k->gen && c->code == k->code && c->scale == k->scale &&
+    c->x == k->x && c->y == k->y && c->reflect == k->reflect &&
+    c->ink == k->ink && c->option == k->option;
+}
+
+static void gcache_op(struct render *r, uint8_t *byte, uint8_t m)
+{
+  struct gop *o;
+  uint16_t off = byte - r->display;
+
+  /* Back to back writes to a byte under the same test combine, as long
+     as the last one is inside the innermost record */
+  if (r->grec_top > r->grec[r->nrec - 1].start) {
+    o = r->grec_ops + r->grec_top - 1;
+    if (o->off == off && o->ob == r->line_ob && o->pm == r->line_pm &&
+        o->ink == r->line_ink) {
+      o->m |= m;
+      return;
     }
-    /* Move on to next record */
-    p  += ((cl & 0x0F) << 8) | *p - 2;
   }
+  if (r->grec_top == GREC_OPS) {
+    r->nrec = 0;
+    return;
+  }
+  o = r->grec_ops + r->grec_top++;
+  o->off = off;
+  o->m = m;
+  o->ob = r->line_ob;
+  o->pm = r->line_pm;
+  o->ink = r->line_ink;
 }
-    
-static void gfexecute(uint8_t * pc)
+
+/* Empty the cache by moving on a generation, only clearing it out when
+   the count wraps */
+static void gcache_flush(struct render *r)
 {
-  static int16_t x, y;
-  
-  if (pc == NULL)
+  if (++r->gcache_gen == 0) {
+    memset(r->gcache, 0, sizeof(r->gcache));
+    r->gcache_gen = 1;
+  }
+  r->gcache_top = 0;
+}
+
+/* Something the cache can't replay happened, drop the records */
+static void gcache_abort(struct render *r)
+{
+  r->nrec = 0;
+  r->grec_top = 0;
+}
+
+/* Fills and replays can't stop part way, so one costing more than is
+   left waits for the next step. The first op of a step always goes
+   ahead (the step is over once it is done) so a small budget still gets
+   somewhere */
+static uint8_t gcharge(struct render *r, unsigned long n)
+{
+  if (n <= r->budget)
+    r->budget -= n;
+  else if (r->budget + 1 == r->step)
+    r->budget = 0;
+  else {
+    r->budget = 0;
+    return 0;
+  }
+  return 1;
+}
+
+/* Play back a sub-picture if we have it, giving 2 if it has to wait */
+static uint8_t gcache_hit(struct render *r, uint16_t code)
+{
+  struct gcache k;
+  struct gcache *c;
+  struct gop *o, *e;
+
+  gcache_key(r, &k, code);
+  c = gcache_slot(r, &k);
+  if (!gcache_match(c, &k))
+    return 0;
+  /* A replay is a lot of ops in one, about a line per 16 writes */
+  if (!gcharge(r, c->nops / 16U))
+    return 2;
+  o = r->gcache_ops + c->op;
+  e = o + c->nops;
+  if (r->nrec) {
+    /* Recording an outer call, so go the long way to log it all */
+    while (o < e) {
+      r->line_ob = o->ob;
+      r->line_pm = o->pm;
+      r->line_ink = o->ink;
+      mayplot_mask(r, r->display + o->off, o->m);
+      o++;
+    }
+  } else {
+    while (o < e) {
+      uint8_t *byte = r->display + o->off;
+      uint8_t t = *byte ^ o->ob;
+      uint8_t m, v;
+      t = ~(t | (t >> 1)) & 0x55;
+      m = o->m & (t | (t << 1)) & o->pm;
+      v = (*byte & ~m) | (o->ink & m);
+      if (v != *byte) {
+        damage_byte(r, byte);
+        *byte = v;
+      }
+      o++;
+    }
+  }
+  r->draw_x = r->new_x = c->ex;
+  r->draw_y = r->new_y = c->ey;
+  r->reflect = c->ereflect;
+  r->ink = c->eink;
+  r->option = c->eoption;
+  return 1;
+}
+
+/* Called with the return address pushed */
+static void gcache_start(struct render *r, uint16_t code)
+{
+  if (r->nrec == 0)
+    r->grec_top = 0;
+  gcache_key(r, &r->grec[r->nrec].key, code);
+  r->grec[r->nrec].start = r->grec_top;
+  r->grec[r->nrec].depth = r->gfxstack - r->gfxstack_base;
+  r->nrec++;
+}
+
+/* Called with the return address popped */
+static void gcache_end(struct render *r)
+{
+  struct gcache *c;
+  uint16_t n;
+
+  if (r->nrec == 0 || r->grec[r->nrec - 1].depth != r->gfxstack - r->gfxstack_base + 1)
     return;
+  r->nrec--;
+  n = r->grec_top - r->grec[r->nrec].start;
+  /* When the cache fills start again */
+  if (r->gcache_top + n > GCACHE_OPS) {
+    gcache_flush(r);
+    if (n > GCACHE_OPS)
+      return;
+  }
+  c = gcache_slot(r, &r->grec[r->nrec].key);
+  *c = r->grec[r->nrec].key;
+  c->gen = r->gcache_gen;
+  c->ex = r->draw_x;
+  c->ey = r->draw_y;
+  c->ereflect = r->reflect;
+  c->eink = r->ink;
+  c->eoption = r->option;
+  c->op = r->gcache_top;
+  c->nops = n;
+  memcpy(r->gcache_ops + r->gcache_top, r->grec_ops + r->grec[r->nrec].start,
+    n * sizeof(struct gop));
+  r->gcache_top += n;
+}
+
+/* Look a picture up, counting it for the profile */
+static uint8_t *gfind_r(struct render *r, uint16_t code)
+{
+  uint8_t *p = gfind(code);
+  PROF(r->prof.gfinds++);
+  PROF(if (p == NULL) r->prof.gfind_misses++);
+  return p;
+}
+
+/* op is the call, to come back to in the next step, and pc after it */
+static uint8_t *gcall(struct render *r, uint16_t code, uint8_t *op, uint8_t *pc)
+{
+  uint8_t *sub;
+  uint8_t hit;
+
+  PROF(r->prof.calls++);
+  /* The cache draws rather than records */
+  hit = r->dl ? 0 : gcache_hit(r, code);
+  if (hit == 2)
+    return op;
+  if (hit) {
+    PROF(r->prof.cache_hits++);
+    return pc;
+  }
+  /* Calls to a missing picture do nothing and a picture that calls
+     itself would run off the stack */
+  sub = gfind_r(r, code);
+  if (sub == NULL)
+    return pc;
+  /* A call dropped for want of stack depends on how deep the records
+     started, so they can't be replayed anywhere else */
+  if (r->gfxstack - r->gfxstack_base == GFXSTACK_SIZE) {
+    gcache_abort(r);
+    return pc;
+  }
+  *r->gfxstack++ = pc;
+  *r->gfxscale++ = r->scale;
+  PROF(if (r->gfxstack - r->gfxstack_base > r->prof.depth)
+    r->prof.depth = r->gfxstack - r->gfxstack_base);
+  if (!r->dl && r->gfxstack - r->gfxstack_base < GFXSTACK_SIZE)
+    gcache_start(r, code);
+  return sub;
+}
+
+/* Run ops until the picture ends, giving NULL, or the budget runs out,
+   giving the op to carry on from. Everything else it needs to carry on
+   is in the render. A bad record stops the picture rather than run off
+   the end of the file */
+static uint8_t *gfexecute(struct render *r, uint8_t * pc)
+{
+  uint8_t *end = pictures + picsize;
+  int16_t x, y;
+
+  if (pc == NULL)
+    return NULL;
 
   while (1) {
-    uint8_t opcode = *pc++;
+    uint8_t opcode;
+
+    if (pc >= end)
+      return NULL;
+    if (r->budget == 0)
+      return pc;
+    r->budget--;
+    opcode = *pc++;
     uint8_t draw = 0;
 
+    PROF(r->prof.ops[opcode < 0xC0 ? opcode >> 6 : opcode < 0xF8 ?
+      3 + ((opcode >> 3) & 7) : 10 + (opcode & 7)]++);
+
     switch (opcode >> 6) {
     case 0:
       draw = 1;
@@ -252,21 +1027,19 @@ static void gfexecute(uint8_t * pc)
       y = (opcode & 0x03) << 2;
       if (opcode & 0x04)
         y = (y | 0xF0) - 0x100;
-      if (reflect & 2)
+      if (r->reflect & 2)
         x = -x;
-      if (reflect & 1)
+      if (r->reflect & 1)
         y = -y;
-      new_x = draw_x + ((x * scale) & ~7);
-      new_y = draw_y + ((y * scale) & ~7);
+      r->new_x = r->draw_x + ((x * r->scale) & ~7);
+      r->new_y = r->draw_y + ((y * r->scale) & ~7);
       if (draw)
-        draw_line();
-      draw_x = new_x;
-      draw_y = new_y;
+        draw_line(r);
+      r->draw_x = r->new_x;
+      r->draw_y = r->new_y;
       break;
     case 2:
-      *gfxstack++ = pc;
-      *gfxscale++ = scale;
-      pc = gfind(opcode & 0x3F);
+      pc = gcall(r, opcode & 0x3F, pc - 1, pc);
       break;
     case 3:
       switch ((opcode >> 3) & 7) {
@@ -274,164 +1047,1353 @@ static void gfexecute(uint8_t * pc)
 	draw = 1;
       case 1:
       {
-        uint16_t coord = ((uint16_t)opcode << 8) | *pc++;
+        uint16_t coord;
+
+        if (pc >= end)
+          return NULL;
+        coord = ((uint16_t)opcode << 8) | *pc++;
         x = (coord & 0x3E0) >> 5;
         if (coord & 0x400)
           x = (x | 0xE0) - 0x100;
         y = (coord & 0x0F) << 2;
         if (coord & 0x10)
           y = (y | 0xC0) - 0x100;
-        if (reflect & 2)
+        if (r->reflect & 2)
           x = -x;
-        if (reflect & 1)
+        if (r->reflect & 1)
           y = -y;
-        new_x = draw_x + ((x * scale) & ~7);
-        new_y = draw_y + ((y * scale) & ~7);
+        r->new_x = r->draw_x + ((x * r->scale) & ~7);
+        r->new_y = r->draw_y + ((y * r->scale) & ~7);
         if (draw)
-          draw_line();
-        draw_x = new_x;
-        draw_y = new_y;
+          draw_line(r);
+        r->draw_x = r->new_x;
+        r->draw_y = r->new_y;
       }
       break;
       case 2:
-	ink = opcode & 3;
+	r->ink = opcode & 3;
 	break;
       case 3:
 	opcode &= 7;
 	if (!opcode) {
-	  scale = 0x80;
+	  r->scale = 0x80;
 	  /* Early games only */
-	  gfxscale = gfxscale_base;
+	  r->gfxscale = r->gfxscale_base;
+	  gcache_abort(r);
         } else {
-          uint16_t ns = (scale * scalemap[opcode]) >> 3;
+          uint16_t ns = (r->scale * scalemap[opcode]) >> 3;
           if (ns > 0xff) {
-            printf("SCALE OVERFLOW\n");
+            gwarn("SCALE OVERFLOW");
             ns = 0xff;
           }
-          scale = ns;
+          r->scale = ns;
         }
         break;
       case 4:
-	fill_current(opcode & 7);
+	if (!gcharge(r, FILL_COST - 1)) {
+	  pc--;
+	  break;
+	}
+	gcache_abort(r);
+	fill_current(r, opcode & 7);
 	break;
       case 5:
-        *gfxstack++ = pc + 1;
-        *gfxscale++ = scale;
-        pc = gfind(((((uint16_t)opcode) & 7) << 8) | *pc);
+        if (pc >= end)
+          return NULL;
+        pc = gcall(r, ((((uint16_t)opcode) & 7) << 8) | *pc, pc - 1, pc + 1);
 	break;
       case 6:
         if (opcode & 4) {
           opcode &= 3;
-          opcode ^= reflect;
+          opcode ^= r->reflect;
         }
-        reflect = opcode;
+        r->reflect = opcode;
         break;
       case 7:
 	switch (opcode & 7) {
 	case 1:
+	  if (pc >= end)
+	    return NULL;
 	  opcode = *pc++;
-	  palette[(opcode >> 3) & 3] = opcode & 7;
+	  r->palette[(opcode >> 3) & 3] = opcode & 7;
+	  if (r->dl)
+	    dl_add(r->dl, DL_PALETTE, (opcode >> 3) & 3, opcode & 7, 0, 0, 0, 0);
+	  gcache_abort(r);
 	  break;
 	case 3:
-	  draw_x = 0x40 * *pc++;
-	  draw_y = 0x40 * *pc++;
+	  if (pc + 1 >= end)
+	    return NULL;
+	  r->draw_x = 0x40 * *pc++;
+	  r->draw_y = 0x40 * *pc++;
 	  break;
 	case 4:
-	  option = *pc ? ((*pc & 3) | 0x80) : 0;
+	  if (pc >= end)
+	    return NULL;
+	  r->option = *pc ? ((*pc & 3) | 0x80) : 0;
 	  pc++;
 	  break;
 	case 7:
-	  if (gfxstack == gfxstack_base)
-	    return;
-	  pc = *--gfxstack;
-          /* Fall through */
+	  if (r->gfxstack == r->gfxstack_base)
+	    return NULL;
+	  pc = *--r->gfxstack;
+	  if (r->gfxscale != r->gfxscale_base)
+	    r->scale = *--r->gfxscale;
+	  gcache_end(r);
+	  break;
 	case 5:
-	  if (gfxscale != gfxscale_base)
-	    scale = *--gfxscale;
+	  gcache_abort(r);
+	  if (r->gfxscale != r->gfxscale_base)
+	    r->scale = *--r->gfxscale;
           break;
 	default:
-	  error("ILGFX");
+	  /* Bad data, give up on the picture rather than the game */
+	  gwarn("ILGFX");
+	  return NULL;
 	}
       }
     }
   }
 }
 
-static void draw_picture(uint16_t pic)
+/*
+ *	A picture is drawn a step at a time so whatever drives it can do
+ *	other things in between, or show it as it goes the way the original
+ *	machines did. draw_start() sets up and each draw_step() runs about
+ *	budget ops, giving 0 once the picture is done. Between steps the
+ *	render holds the lot, stacks included, and the display shows what
+ *	has been drawn so far. Starting another picture drops the last.
+ */
+static void draw_start(struct render *r, uint16_t pic)
 {
-  ink = 3;
-  option = 0;
-  reflect = 0;
-  draw_x = 0x1400;
-  draw_y = 0x1400;
-  scale = 0x80;
-  gfxstack = gfxstack_base;
-  gfxscale = gfxscale_base;
-  gfexecute(gfind(0));
-  gfexecute(gfind(pic));
+  r->ink = 3;
+  r->option = 0;
+  r->reflect = 0;
+  r->draw_x = 0x1400;
+  r->draw_y = 0x1400;
+  r->scale = 0x80;
+  r->gfxstack = r->gfxstack_base;
+  r->gfxscale = r->gfxscale_base;
+  gcache_abort(r);
+  r->gpc = gfind_r(r, 0);
+  r->gpic = pic;
+  r->gsetup = 1;
 }
 
-static const char *palmap[8] = {
-  "0 0 0",
-  "255 0 0",
-  "0 255 0",	/* Some machines have a rather saner green */
-  "255 255 0",
-  "0 0 255",
-  "255 0 255",	/* Magenta or brown, brown is better ! */
-  "0 255 255",
-  "255 255 255"
-};
+static uint8_t draw_step(struct render *r, unsigned long budget)
+{
+  r->budget = r->step = budget;
+  while (1) {
+    r->gpc = gfexecute(r, r->gpc);
+    if (r->gpc)
+      return 1;
+    if (!r->gsetup)
+      return 0;
+    /* The picture itself starts from where the setup left things */
+    r->gsetup = 0;
+    r->gpc = gfind_r(r, r->gpic);
+  }
+}
 
-static void printrgb(FILE *o, uint8_t c)
+static void draw_picture(struct render *r, uint16_t pic)
 {
-  fprintf(o, "%s ", palmap[palette[c]]);
+  draw_start(r, pic);
+  draw_step(r, DRAW_ALL);
 }
 
-static void write_ppm(FILE *o)
+static struct dlist *dl_compile(struct render *r, uint16_t pic)
 {
-	uint8_t c;
-	uint8_t x, y;
+  struct dlist *d = calloc(1, sizeof(struct dlist));
 
-	fprintf(o, "P3\n160 128 3\n");
+  if (d == NULL)
+    error("out of memory");
+  r->dl = d;
+  draw_picture(r, pic);
+  r->dl = NULL;
+  return d;
+}
 
-	for (y = 0; y < 128; y++) {
-		for (x = 0; x < 160; x++) {
-		  c = peek(x, y);
-		  printrgb(o, c);
-		}
-		fprintf(o, "\n");
-	}
+static void dl_free(struct dlist *d)
+{
+  free(d->op);
+  free(d);
 }
 
-int main(int argc, char *argv[])
+/* Draw a list on the display just as running the picture would */
+static void dl_replay(struct render *r, struct dlist *d)
 {
-  int fd;
-  FILE *o;
+  struct dlop *o = d->op;
+  struct dlop *e = o + d->len;
 
-  if (argc != 3) {
-    fprintf(stderr, "g9x: picturefile number\n");
-    exit(1);
+  for (; o < e; o++) {
+    switch(o->op) {
+      case DL_LINE:
+        r->ink = o->a;
+        r->option = o->b;
+        line(r, o->x0 >> 6, 127 - (o->y0 >> 7), o->x1 >> 6, 127 - (o->y1 >> 7));
+        break;
+      case DL_FILL:
+        fill(r, o->x0 >> 6, 127 - (o->y0 >> 7), o->a, o->b);
+        break;
+      case DL_PALETTE:
+        r->palette[o->a] = o->b;
+        break;
+    }
   }
-  fd = open(argv[1], O_RDONLY);
-  if (fd == -1) {
-    perror(argv[1]);
-    exit(1);
+}
+
+/*
+ *	Drawing a list at other resolutions. The picture space is 10240 by
+ *	16384 (160 by 128 pixels of 64 by 128), scaled to the canvas with y
+ *	going down. Lines and fills follow the same rules as on the display,
+ *	including the option colour test and mayplot()'s missing leftmost
+ *	pixel of each byte, which here is every fourth column of the original
+ *	pixels so the look is the same at any size.
+ */
+
+static int32_t cv_floor(int32_t a, int32_t b)
+{
+  return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+static int32_t cv_x(struct canvas *c, int16_t x)
+{
+  return cv_floor((int32_t)x * c->w, 10240);
+}
+
+static int32_t cv_y(struct canvas *c, int16_t y)
+{
+  return c->h - 1 - cv_floor((int32_t)y * c->h, 16384);
+}
+
+static void cv_line(struct canvas *c, struct dlop *o)
+{
+  int32_t x = cv_x(c, o->x0), y = cv_y(c, o->y0);
+  int32_t x1 = cv_x(c, o->x1), y1 = cv_y(c, o->y1);
+  int32_t dx = abs(x1 - x), dy = -abs(y1 - y);
+  int32_t sx = x < x1 ? 1 : -1, sy = y < y1 ? 1 : -1;
+  int32_t err = dx + dy, e2;
+  uint8_t want = o->b & 3;
+  uint8_t skip = o->b & 0x80;
+  uint8_t *p;
+
+  while (1) {
+    if (x >= 0 && x < c->w && y >= 0 && y < c->h) {
+      p = c->pix + y * c->w + x;
+      if (*p == want && !(skip && ((x * 160 / c->w) & 3) == 0))
+        *p = o->a;
+    }
+    if (x == x1 && y == y1)
+      break;
+    e2 = 2 * err;
+    if (e2 >= dy) {
+      err += dy;
+      x += sx;
+    }
+    if (e2 <= dx) {
+      err += dx;
+      y += sy;
+    }
   }
-  if (read(fd, pictures, sizeof(pictures)) < 1024) {
-    fprintf(stderr, "Invalid picture data.\n");
-    exit(1);
+}
+
+static void cv_push(struct canvas *c, uint32_t *sp, uint32_t v)
+{
+  if (*sp == c->stack_size) {
+    c->stack_size = c->stack_size ? c->stack_size * 2 : 1024;
+    c->stack = realloc(c->stack, c->stack_size * sizeof(uint32_t));
+    if (c->stack == NULL)
+      error("out of memory");
   }
-  close(fd);
-  draw_picture(atoi(argv[2]));
+  c->stack[(*sp)++] = v;
+}
 
-  o = fopen("out.ppm", "w");
-  if (o == NULL) {
-    perror("out.ppm");
-    exit(1);
+/* Seed each run of old colour between xl and xr on row y */
+static void cv_seeds(struct canvas *c, uint32_t *sp, int32_t xl, int32_t xr,
+  int32_t y, uint8_t c2)
+{
+  uint8_t *row = c->pix + y * c->w;
+  uint8_t in = 0;
+
+  for (; xl <= xr; xl++) {
+    if (row[xl] == c2) {
+      if (!in)
+        cv_push(c, sp, y * c->w + xl);
+      in = 1;
+    } else
+      in = 0;
+  }
+}
+
+static void cv_fill(struct canvas *c, struct dlop *o)
+{
+  int32_t x = cv_x(c, o->x0), y = cv_y(c, o->y0);
+  int32_t xl, xr;
+  uint32_t sp = 0;
+  uint8_t *row;
+  uint8_t c2 = o->b;
+
+  if (x < 0 || x >= c->w || y < 0 || y >= c->h ||
+      c->pix[y * c->w + x] != c2 || o->a == c2)
+    return;
+  cv_push(c, &sp, y * c->w + x);
+  while (sp) {
+    sp--;
+    y = c->stack[sp] / c->w;
+    x = c->stack[sp] % c->w;
+    row = c->pix + y * c->w;
+    if (row[x] != c2)
+      continue;
+    for (xl = x; xl > 0 && row[xl - 1] == c2; xl--);
+    for (xr = x; xr < c->w - 1 && row[xr + 1] == c2; xr++);
+    memset(row + xl, o->a, xr - xl + 1);
+    if (y > 0)
+      cv_seeds(c, &sp, xl, xr, y - 1, c2);
+    if (y < c->h - 1)
+      cv_seeds(c, &sp, xl, xr, y + 1, c2);
   }
-  write_ppm(o);
-  fclose(o);
-  return 0;
 }
 
-  
\ No newline at end of file
+static void dl_render(struct dlist *d, struct canvas *c)
+{
+  struct dlop *o = d->op;
+  struct dlop *e = o + d->len;
+
+  for (; o < e; o++) {
+    switch(o->op) {
+      case DL_LINE:
+        cv_line(c, o);
+        break;
+      case DL_FILL:
+        cv_fill(c, o);
+        break;
+      case DL_PALETTE:
+        c->palette[o->a] = o->b;
+        break;
+    }
+  }
+}
+
+/* Colour numbers are RGB bits */
+static const uint8_t palrgb[8][3] = {
+  { 0, 0, 0 },
+  { 255, 0, 0 },
+  { 0, 255, 0 },	/* Some machines have a rather saner green */
+  { 255, 255, 0 },
+  { 0, 0, 255 },
+  { 255, 0, 255 },	/* Magenta or brown, brown is better ! */
+  { 0, 255, 255 },
+  { 255, 255, 255 }
+};
+
+/* Pixel size of the images written, -x */
+static uint8_t out_scale = 1;
+
+/* Each display byte is four pixels, so a byte at a time can go through
+   tables built from the current palette, the RGB one already widened */
+static void build_lut(struct render *r)
+{
+  unsigned b;
+  uint8_t i, j, c;
+  uint8_t *p;
+
+  if (memcmp(r->lut_palette, r->palette, sizeof(r->palette)) == 0 &&
+      r->lut_scale == out_scale)
+    return;
+  memcpy(r->lut_palette, r->palette, sizeof(r->palette));
+  r->lut_scale = out_scale;
+  for (b = 0; b < 256; b++) {
+    p = r->rgb_lut[b];
+    for (i = 0; i < 4; i++) {
+      c = r->palette[(b >> (i << 1)) & 3] & 7;
+      r->idx_lut[b][i] = c;
+      for (j = 0; j < out_scale; j++) {
+        memcpy(p, palrgb[c], 3);
+        p += 3;
+      }
+    }
+  }
+}
+
+/*
+ *	The writers work a row at a time, each pixel repeated across for the
+ *	scale and the finished row repeated down. Colour numbers come from
+ *	unpacking a display row through the palette: with SSE2 sixteen
+ *	display bytes (64 pixels) are unpacked, looked up and widened by two
+ *	or four at once, other scales and other machines use the byte table.
+ *	Where the processor has SSSE3 (checked when run, the build is for
+ *	plain SSE2) RGB comes from those colour numbers sixteen pixels at a
+ *	time: each pixel byte is shuffled out to its three places and each
+ *	place tests its own colour bit. Otherwise RGB goes a byte at a time
+ *	through its table.
+ */
+
+#ifdef __SSE2__
+static __m128i expand_pal(__m128i x, __m128i *pal)
+{
+  __m128i c;
+
+  c = _mm_and_si128(_mm_cmpeq_epi8(x, _mm_setzero_si128()), pal[0]);
+  c = _mm_or_si128(c, _mm_and_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(1)), pal[1]));
+  c = _mm_or_si128(c, _mm_and_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(2)), pal[2]));
+  return _mm_or_si128(c, _mm_and_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(3)), pal[3]));
+}
+
+/* Write v with each byte repeated n (1, 2 or 4) times */
+static uint8_t *expand_store(uint8_t *p, __m128i v, uint8_t n)
+{
+  if (n == 1) {
+    _mm_storeu_si128((__m128i *)p, v);
+    return p + 16;
+  }
+  p = expand_store(p, _mm_unpacklo_epi8(v, v), n >> 1);
+  return expand_store(p, _mm_unpackhi_epi8(v, v), n >> 1);
+}
+
+/* Bytes d to d + 15, the pixels of each from bit 0 up */
+static uint8_t *expand16(const uint8_t *d, uint8_t *p, __m128i *pal, uint8_t n)
+{
+  __m128i m = _mm_set1_epi8(3);
+  __m128i v = _mm_loadu_si128((const __m128i *)d);
+  __m128i p0 = expand_pal(_mm_and_si128(v, m), pal);
+  __m128i p1 = expand_pal(_mm_and_si128(_mm_srli_epi16(v, 2), m), pal);
+  __m128i p2 = expand_pal(_mm_and_si128(_mm_srli_epi16(v, 4), m), pal);
+  __m128i p3 = expand_pal(_mm_and_si128(_mm_srli_epi16(v, 6), m), pal);
+  __m128i lo = _mm_unpacklo_epi8(p0, p1);
+  __m128i hi = _mm_unpackhi_epi8(p0, p1);
+  __m128i lo2 = _mm_unpacklo_epi8(p2, p3);
+  __m128i hi2 = _mm_unpackhi_epi8(p2, p3);
+
+  p = expand_store(p, _mm_unpacklo_epi16(lo, lo2), n);
+  p = expand_store(p, _mm_unpackhi_epi16(lo, lo2), n);
+  p = expand_store(p, _mm_unpacklo_epi16(hi, hi2), n);
+  return expand_store(p, _mm_unpackhi_epi16(hi, hi2), n);
+}
+#endif
+
+static void expand_row(struct render *r, const uint8_t *d, uint8_t *p, uint8_t n)
+{
+  const uint8_t *e = d + 40;
+  uint8_t *t;
+  uint8_t i;
+
+#ifdef __SSE2__
+  if (n != 3) {
+    __m128i pal[4];
+
+    for (i = 0; i < 4; i++)
+      pal[i] = _mm_set1_epi8(r->palette[i] & 7);
+    expand16(d, p, pal, n);
+    expand16(d + 16, p + 64 * n, pal, n);
+    /* The last 8 bytes, going over 8 already done */
+    expand16(d + 24, p + 96 * n, pal, n);
+    return;
+  }
+#endif
+  build_lut(r);
+  while (d < e) {
+    t = r->idx_lut[*d++];
+    for (i = 0; i < 4; i++) {
+      memset(p, t[i], n);
+      p += n;
+    }
+  }
+}
+
+#ifdef __SSE2__
+/* Colour numbers c to RGB at p, n a multiple of 16 */
+__attribute__((target("ssse3")))
+static void rgb_row(const uint8_t *c, uint8_t *p, unsigned n)
+{
+  /* Output byte j of 48 is bit j % 3 of pixel j / 3 */
+  static const uint8_t spread[3][16] = {
+    { 0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5 },
+    { 5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10 },
+    { 10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15 }
+  };
+  static const uint8_t bit[3][16] = {
+    { 1, 2, 4, 1, 2, 4, 1, 2, 4, 1, 2, 4, 1, 2, 4, 1 },
+    { 2, 4, 1, 2, 4, 1, 2, 4, 1, 2, 4, 1, 2, 4, 1, 2 },
+    { 4, 1, 2, 4, 1, 2, 4, 1, 2, 4, 1, 2, 4, 1, 2, 4 }
+  };
+  const uint8_t *e = c + n;
+  __m128i s[3], m[3], v, t;
+  uint8_t i;
+
+  for (i = 0; i < 3; i++) {
+    s[i] = _mm_loadu_si128((const __m128i *)spread[i]);
+    m[i] = _mm_loadu_si128((const __m128i *)bit[i]);
+  }
+  for (; c < e; c += 16) {
+    v = _mm_loadu_si128((const __m128i *)c);
+    for (i = 0; i < 3; i++) {
+      t = _mm_and_si128(_mm_shuffle_epi8(v, s[i]), m[i]);
+      _mm_storeu_si128((__m128i *)p, _mm_cmpeq_epi8(t, m[i]));
+      p += 16;
+    }
+  }
+}
+#endif
+
+static void write_image(struct render *r, FILE *o, uint8_t *end)
+{
+  if (fwrite(r->image, end - r->image, 1, o) != 1)
+    error("write error");
+}
+
+/* Repeat the row just written at p - w down for the scale */
+static uint8_t *repeat_row(uint8_t *p, unsigned w, uint8_t n)
+{
+  while (--n) {
+    memcpy(p, p - w, w);
+    p += w;
+  }
+  return p;
+}
+
+/* Binary PPM */
+static void write_ppm(struct render *r, FILE *o)
+{
+  uint8_t n = out_scale;
+  unsigned w = 12 * n;
+  uint8_t *p = r->image;
+  uint8_t *d = r->display;
+  uint8_t *e;
+
+  p += sprintf((char *)p, "P6\n%u %u 255\n", 160 * n, 128 * n);
+#ifdef __SSE2__
+  if (__builtin_cpu_supports("ssse3")) {
+    uint8_t row[160 * MAX_SCALE];
+
+    for (; d < r->display + sizeof(r->display); d += 40) {
+      expand_row(r, d, row, n);
+      rgb_row(row, p, 160 * n);
+      p = repeat_row(p + 480 * n, 480 * n, n);
+    }
+    write_image(r, o, p);
+    return;
+  }
+#endif
+  build_lut(r);
+  while (d < r->display + sizeof(r->display)) {
+    if (n == 1) {
+      for (e = d + 40; d < e; p += 12)
+        memcpy(p, r->rgb_lut[*d++], 12);
+    } else {
+      for (e = d + 40; d < e; p += w)
+        memcpy(p, r->rgb_lut[*d++], w);
+      p = repeat_row(p, 40 * w, n);
+    }
+  }
+  write_image(r, o, p);
+}
+
+/* Raw 160x128 bytes (more when scaled), each the colour number 0-7 */
+static void write_raw(struct render *r, FILE *o)
+{
+  uint8_t n = out_scale;
+  uint8_t *p = r->image;
+  uint8_t *d = r->display;
+
+  for (; d < r->display + sizeof(r->display); d += 40) {
+    expand_row(r, d, p, n);
+    p = repeat_row(p + 160 * n, 160 * n, n);
+  }
+  write_image(r, o, p);
+}
+
+/*
+ *	Sixel output for terminals. Each band of six rows is sent as a pass
+ *	per colour of one character per column, run length encoded, worked
+ *	out from the packed display bytes a byte (four columns) at a time.
+ *
+ *	Updates are drawn transparently over what the terminal has, so
+ *	only the bands touched since the last update are sent and each of
+ *	those only across the columns written. The write damage is narrowed
+ *	down by comparing it against what was last sent, so redrawing the
+ *	same thing again costs nothing. Bands and columns that stay the same
+ *	are skipped with newlines and blank sixels. A palette change means
+ *	sending it all again.
+ */
+
+static uint8_t *put_num(uint8_t *p, unsigned n)
+{
+  if (n >= 10)
+    p = put_num(p, n / 10);
+  *p++ = '0' + n % 10;
+  return p;
+}
+
+static uint8_t *put_str(uint8_t *p, const char *s)
+{
+  while (*s)
+    *p++ = *s++;
+  return p;
+}
+
+static uint8_t *sixel_run(uint8_t *p, uint8_t c, uint8_t n)
+{
+  if (n > 3) {
+    *p++ = '!';
+    p = put_num(p, n);
+    *p++ = c;
+  } else
+    while (n--)
+      *p++ = c;
+  return p;
+}
+
+/* Encode columns lo to hi (bytes) of the six rows from y in colour c,
+   skipping to the first column with blank sixels */
+static uint8_t *sixel_band(struct render *r, uint8_t *p, uint8_t y,
+  uint8_t lo, uint8_t hi, uint8_t c)
+{
+  uint8_t six[160];
+  uint8_t *row;
+  uint8_t b, k, t, i;
+  uint8_t x, end, n;
+
+  memset(six + lo * 4, 0, (hi - lo + 1) * 4);
+  for (k = 0; k < 6 && y + k < 128; k++) {
+    row = r->display + (y + k) * 40;
+    for (b = lo; b <= hi; b++) {
+      /* Bits 0, 2, 4, 6 set for the pixels of colour c */
+      t = row[b] ^ (c * 0x55);
+      t = ~(t | (t >> 1)) & 0x55;
+      for (i = 0; t; i++, t >>= 2)
+        if (t & 1)
+          six[b * 4 + i] |= 1 << k;
+    }
+  }
+  end = hi * 4 + 4;
+  while (end > lo * 4 && six[end - 1] == 0)
+    end--;
+  if (end == lo * 4)
+    return p;
+  *p++ = '#';
+  p = put_num(p, c);
+  if (lo)
+    p = sixel_run(p, '?', lo * 4);
+  for (x = lo * 4; x < end; x += n) {
+    for (n = 1; x + n < end && six[x + n] == six[x] && n < 255; n++);
+    p = sixel_run(p, '?' + six[x], n);
+  }
+  *p++ = '$';
+  return p;
+}
+
+/* A whole picture, or with update set just what changed since the last
+   update drawn over it at the top left of the screen */
+static void write_sixel(struct render *r, FILE *o, uint8_t update)
+{
+  uint8_t *p = r->image;
+  uint8_t y, k, c, lo, hi, nl = 0;
+  uint8_t *d, *sh;
+
+  /* A new palette changes the colour of everything */
+  if (memcmp(r->shown_palette, r->palette, sizeof(r->palette)))
+    r->shown_ok = 0;
+  if (update)
+    p = put_str(p, "\0337\033[H");
+  p = put_str(p, "\033P0;1q\"1;1;160;128");
+  for (c = 0; c < 4; c++) {
+    const uint8_t *rgb = palrgb[r->palette[c] & 7];
+    *p++ = '#';
+    p = put_num(p, c);
+    p = put_str(p, ";2;");
+    for (k = 0; k < 3; k++) {
+      if (k)
+        *p++ = ';';
+      p = put_num(p, rgb[k] * 100 / 255);
+    }
+  }
+  for (y = 0; y < 128; y += 6) {
+    lo = 0;
+    hi = 39;
+    if (update && r->shown_ok) {
+      lo = 255;
+      hi = 0;
+      for (k = y; k < y + 6 && k < 128; k++) {
+        d = r->display + k * 40;
+        sh = r->shown + k * 40;
+        /* Trim the damage to what really differs */
+        while (r->dirty_lo[k] <= r->dirty_hi[k] &&
+               d[r->dirty_lo[k]] == sh[r->dirty_lo[k]])
+          r->dirty_lo[k]++;
+        while (r->dirty_lo[k] <= r->dirty_hi[k] &&
+               d[r->dirty_hi[k]] == sh[r->dirty_hi[k]])
+          r->dirty_hi[k]--;
+        if (r->dirty_lo[k] > r->dirty_hi[k])
+          continue;
+        if (r->dirty_lo[k] < lo)
+          lo = r->dirty_lo[k];
+        if (r->dirty_hi[k] > hi)
+          hi = r->dirty_hi[k];
+      }
+      if (lo > hi) {
+        nl++;
+        continue;
+      }
+    }
+    while (nl) {
+      *p++ = '-';
+      nl--;
+    }
+    for (c = 0; c < 4; c++)
+      p = sixel_band(r, p, y, lo, hi, c);
+    nl = 1;
+  }
+  p = put_str(p, "\033\\");
+  if (update)
+    p = put_str(p, "\0338");
+  memcpy(r->shown, r->display, sizeof(r->shown));
+  memcpy(r->shown_palette, r->palette, sizeof(r->palette));
+  r->shown_ok = 1;
+  memset(r->dirty_lo, 255, sizeof(r->dirty_lo));
+  memset(r->dirty_hi, 0, sizeof(r->dirty_hi));
+  write_image(r, o, p);
+}
+
+/* Output size, 0 for the display itself */
+static uint16_t out_w, out_h;
+
+static struct render *render_new(void)
+{
+  struct render *r = calloc(1, sizeof(struct render));
+  if (r == NULL)
+    error("out of memory");
+  r->gcache_gen = 1;
+  memset(r->lut_palette, 255, sizeof(r->lut_palette));
+  memset(r->dirty_lo, 255, sizeof(r->dirty_lo));
+  if (out_w) {
+    r->cv = calloc(1, sizeof(struct canvas));
+    if (r->cv == NULL)
+      error("out of memory");
+    r->cv->w = out_w;
+    r->cv->h = out_h;
+    r->cv->pix = malloc(out_w * out_h);
+    r->cv->out = malloc(out_w * out_h * 3 + 32);
+    if (r->cv->pix == NULL || r->cv->out == NULL)
+      error("out of memory");
+  }
+  return r;
+}
+
+static void render_free(struct render *r)
+{
+  if (r->cv) {
+    free(r->cv->pix);
+    free(r->cv->out);
+    free(r->cv->stack);
+    free(r->cv);
+  }
+  free(r);
+}
+
+/* Each picture starts on a black screen with the palette unset */
+static void render_clear(struct render *r)
+{
+  memset(r->display, 0, sizeof(r->display));
+  memset(r->palette, 0, sizeof(r->palette));
+  memset(r->dirty_lo, 0, sizeof(r->dirty_lo));
+  memset(r->dirty_hi, 39, sizeof(r->dirty_hi));
+  if (r->cv) {
+    memset(r->cv->pix, 0, r->cv->w * r->cv->h);
+    memset(r->cv->palette, 0, sizeof(r->cv->palette));
+  }
+}
+
+/*
+ *	Picture atlas. g9x -A atlas picturefile draws every picture once and
+ *	keeps the finished display and palette of each in a file, keyed by
+ *	code and tagged with a checksum of the picture file. With -a atlas a
+ *	picture found there is a copy out of the mapped file and anything
+ *	else is drawn as normal. An atlas for a different picture file is
+ *	ignored.
+ */
+
+#define ATLAS_MAGIC	"G9XA"
+#define ATLAS_VERSION	1
+
+struct atlas {
+  char magic[4];
+  uint32_t version;
+  uint64_t sum;		/* Of the picture file */
+  uint32_t picsize;
+  uint32_t nframes;
+  uint32_t index[0x800];	/* Frame + 1 by code, 0 if none */
+};
+
+struct aframe {
+  uint8_t display[128 * 160 / 4];
+  uint8_t palette[4];
+};
+
+static struct atlas *atlas;	/* Mapped with the frames following */
+
+static uint64_t atlas_sum(void)
+{
+  uint64_t h = 0xCBF29CE484222325ULL;
+  uint32_t i;
+
+  for (i = 0; i < picsize; i++) {
+    h ^= pictures[i];
+    h *= 0x100000001B3ULL;
+  }
+  return h;
+}
+
+static void atlas_build(const char *name)
+{
+  struct render *r = render_new();
+  struct atlas *h = calloc(1, sizeof(struct atlas));
+  struct aframe f;
+  char tmp[512];
+  FILE *o;
+  uint16_t i;
+  int bad = 0;
+
+  if (h == NULL)
+    error("out of memory");
+  /* Written beside it and renamed over so a reader never sees half */
+  snprintf(tmp, sizeof(tmp), "%s.tmp", name);
+  o = fopen(tmp, "w");
+  if (o == NULL) {
+    perror(tmp);
+    exit(1);
+  }
+  memcpy(h->magic, ATLAS_MAGIC, 4);
+  h->version = ATLAS_VERSION;
+  h->sum = atlas_sum();
+  h->picsize = picsize;
+  if (fseek(o, sizeof(struct atlas), SEEK_SET) == -1)
+    bad = 1;
+  for (i = 0; i < npics && !bad; i++) {
+    render_clear(r);
+    draw_picture(r, piclist[i]);
+    memcpy(f.display, r->display, sizeof(f.display));
+    memcpy(f.palette, r->palette, sizeof(f.palette));
+    if (fwrite(&f, sizeof(f), 1, o) != 1)
+      bad = 1;
+    h->index[piclist[i]] = ++h->nframes;
+  }
+  if (!bad && (fseek(o, 0, SEEK_SET) == -1 ||
+      fwrite(h, sizeof(struct atlas), 1, o) != 1))
+    bad = 1;
+  if (ferror(o))
+    bad = 1;
+  /* A short atlas must never replace a good one */
+  if (fclose(o) || bad || rename(tmp, name) == -1) {
+    perror(name);
+    unlink(tmp);
+    exit(1);
+  }
+  free(h);
+  render_free(r);
+}
+
+static void atlas_open(const char *name)
+{
+  struct stat st;
+  struct atlas *h;
+  int fd = open(name, O_RDONLY);
+
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    perror(name);
+    exit(1);
+  }
+  if (st.st_size < sizeof(struct atlas))
+    error("g9x: bad atlas");
+  h = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (h == MAP_FAILED) {
+    perror(name);
+    exit(1);
+  }
+  close(fd);
+  if (memcmp(h->magic, ATLAS_MAGIC, 4) || h->version != ATLAS_VERSION ||
+      sizeof(struct atlas) + (uint64_t)h->nframes * sizeof(struct aframe) >
+      st.st_size)
+    error("g9x: bad atlas");
+  if (h->picsize != picsize || h->sum != atlas_sum()) {
+    fprintf(stderr, "g9x: atlas is for another picture file, not using it\n");
+    munmap(h, st.st_size);
+    return;
+  }
+  atlas = h;
+}
+
+/* Copy a finished picture out of the atlas if it has it */
+static uint8_t atlas_draw(struct render *r, uint16_t code)
+{
+  struct aframe *f;
+  uint32_t n;
+
+  if (atlas == NULL || code >= 0x800)
+    return 0;
+  n = atlas->index[code];
+  if (n == 0 || n > atlas->nframes)
+    return 0;
+  f = (struct aframe *)(atlas + 1) + n - 1;
+  memcpy(r->display, f->display, sizeof(r->display));
+  memcpy(r->palette, f->palette, sizeof(r->palette));
+  memset(r->dirty_lo, 0, sizeof(r->dirty_lo));
+  memset(r->dirty_hi, 39, sizeof(r->dirty_hi));
+  return 1;
+}
+
+/* At other sizes the picture is compiled and the list drawn */
+static void render_picture(struct render *r, uint16_t code)
+{
+  struct dlist *d;
+
+  if (r->cv == NULL) {
+    if (!atlas_draw(r, code))
+      draw_picture(r, code);
+    return;
+  }
+  d = dl_compile(r, code);
+  dl_render(d, r->cv);
+  dl_free(d);
+}
+
+#define FMT_PPM		0
+#define FMT_RAW		1
+#define FMT_SIXEL	2
+
+static const char *fmtname[] = { "ppm", "raw", "sixel", NULL };
+
+/* PPM or raw at the canvas size, there are no sixels */
+static void write_canvas(struct canvas *c, FILE *o, uint8_t fmt)
+{
+  uint8_t *p = c->out;
+  uint8_t *s = c->pix;
+  uint8_t *e = s + c->w * c->h;
+  uint8_t v;
+
+  if (fmt == FMT_RAW) {
+    while (s < e)
+      *p++ = c->palette[*s++] & 7;
+  } else {
+    p += sprintf((char *)p, "P6\n%u %u 255\n", c->w, c->h);
+    while (s < e) {
+      v = c->palette[*s++] & 7;
+      memcpy(p, palrgb[v], 3);
+      p += 3;
+    }
+  }
+  if (fwrite(c->out, p - c->out, 1, o) != 1)
+    error("write error");
+}
+
+static void save_image(struct render *r, const char *name, uint8_t fmt)
+{
+  FILE *o;
+
+  if (strcmp(name, "-") == 0)
+    o = stdout;
+  else
+    o = fopen(name, "w");
+  if (o == NULL) {
+    perror(name);
+    exit(1);
+  }
+  if (r->cv)
+    write_canvas(r->cv, o, fmt);
+  else if (fmt == FMT_RAW)
+    write_raw(r, o);
+  else if (fmt == FMT_SIXEL)
+    write_sixel(r, o, 0);
+  else
+    write_ppm(r, o);
+  if (fclose(o)) {
+    perror(name);
+    exit(1);
+  }
+}
+
+/*
+ *	Batch rendering. The picture data is loaded once and shared, and
+ *	each worker thread takes the next picture off the list until it runs
+ *	out, drawing it with a render context of its own and writing it to
+ *	dir/number.ppm (or .raw or .sixel).
+ */
+
+#define BATCH_THREADS	64
+
+static uint16_t batch_first;
+static uint16_t batch_last = 0x7FF;
+static const char *batch_dir = ".";
+static uint8_t batch_fmt;
+static uint16_t batch_next;
+static pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int batch_take(uint16_t *code)
+{
+  int r = 0;
+
+  pthread_mutex_lock(&batch_lock);
+  while (batch_next < npics) {
+    *code = piclist[batch_next++];
+    if (*code >= batch_first && *code <= batch_last) {
+      r = 1;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&batch_lock);
+  return r;
+}
+
+static void *batch_worker(void *unused)
+{
+  struct render *r = render_new();
+  char name[512];
+  uint16_t code;
+
+  while (batch_take(&code)) {
+    render_clear(r);
+    render_picture(r, code);
+    snprintf(name, sizeof(name), "%s/%u.%s", batch_dir, code,
+      fmtname[batch_fmt]);
+    save_image(r, name, batch_fmt);
+  }
+  render_free(r);
+  return NULL;
+}
+
+static void batch(int threads)
+{
+  pthread_t tid[BATCH_THREADS];
+  int i;
+
+  if (threads < 1)
+    threads = 1;
+  if (threads > BATCH_THREADS)
+    threads = BATCH_THREADS;
+  for (i = 0; i < threads; i++) {
+    if (pthread_create(&tid[i], NULL, batch_worker, NULL))
+      error("pthread_create failed");
+  }
+  for (i = 0; i < threads; i++)
+    pthread_join(tid[i], NULL);
+}
+
+/*
+ *	Co-process mode. l9x runs us with commands on stdin and waits for
+ *	acknowledgements on stdout. Each command is three bytes, the command
+ *	and a 16bit little endian argument, which must match l9x.c.
+ *
+ *	The game doesn't wait for us so commands can pile up while we draw.
+ *	Each picture covers the whole screen, so we take everything that has
+ *	arrived and only draw the last picture (or clear) in it. A mode
+ *	change throws away anything pending before it and is acknowledged
+ *	at once. A picture new to us is drawn SERVE_STEP ops at a time,
+ *	looking for commands in between so a newer picture can take over
+ *	part way, and then compiled to a display list to be drawn from after.
+ *	An image file is replaced with a rename so anything watching it
+ *	never sees half a picture, while sixels go straight to the output
+ *	(normally the terminal) as updates, each step as it is drawn.
+ */
+
+#define GFX_MODE	'M'
+#define GFX_CLEAR	'C'
+#define GFX_PICTURE	'P'
+#define GFX_ACK		'A'
+
+#define SERVE_STEP	512	/* Ops between looks at the commands */
+
+static struct dlist *serve_dls[0x1000];
+
+static void serve_show(struct render *r, const char *out, uint8_t fmt)
+{
+  static FILE *term;
+  char tmp[512];
+
+  if (fmt == FMT_SIXEL) {
+    if (term == NULL && (term = fopen(out, "w")) == NULL) {
+      perror(out);
+      exit(1);
+    }
+    write_sixel(r, term, 1);
+    fflush(term);
+    return;
+  }
+  snprintf(tmp, sizeof(tmp), "%s.tmp", out);
+  save_image(r, tmp, fmt);
+  if (rename(tmp, out) == -1) {
+    perror(out);
+    exit(1);
+  }
+}
+
+/* Draw a picture the quick way, from the atlas or its display list,
+   giving 0 if there isn't one and it has to be run */
+static uint8_t serve_draw(struct render *r, uint16_t code)
+{
+  struct dlist *d;
+
+  if (r->cv == NULL && atlas_draw(r, code))
+    return 1;
+  if (code >= 0x1000) {
+    render_picture(r, code);
+    return 1;
+  }
+  d = serve_dls[code];
+  if (d == NULL) {
+    if (r->cv == NULL)
+      return 0;
+    d = serve_dls[code] = dl_compile(r, code);
+  }
+  if (r->cv)
+    dl_render(d, r->cv);
+  else
+    dl_replay(r, d);
+  return 1;
+}
+
+static void serve(const char *out, uint8_t fmt)
+{
+  struct render *r = render_new();
+  struct pollfd p;
+  uint8_t buf[384];
+  uint8_t *m;
+  int len = 0;
+  int l;
+  uint8_t mode = 0;
+  uint8_t cmd = 0;	/* What to draw once the input runs dry */
+  uint16_t arg = 0;
+  uint8_t drawing = 0;	/* Part way through a picture */
+
+  p.fd = 0;
+  p.events = POLLIN;
+  while (1) {
+    if (drawing && poll(&p, 1, 0) <= 0) {
+      drawing = draw_step(r, SERVE_STEP);
+      if (drawing == 0 || fmt == FMT_SIXEL)
+        serve_show(r, out, fmt);
+      /* Seen whole, so compile it for next time unless it already is */
+      if (drawing == 0 && serve_dls[r->gpic] == NULL)
+        serve_dls[r->gpic] = dl_compile(r, r->gpic);
+      continue;
+    }
+    l = read(0, buf + len, sizeof(buf) - len);
+    if (l <= 0)
+      return;
+    len += l;
+    for (m = buf; m + 3 <= buf + len; m += 3) {
+      switch(*m) {
+        case GFX_MODE:
+          mode = m[1];
+          cmd = 0;
+          drawing = 0;
+          if (write(1, "A", 1) != 1)
+            return;
+          break;
+        case GFX_CLEAR:
+        case GFX_PICTURE:
+          if (mode) {
+            cmd = *m;
+            arg = m[1] | (m[2] << 8);
+            drawing = 0;
+          }
+          break;
+        default:
+          error("g9x: bad command");
+      }
+    }
+    /* Keep any part command for the next read */
+    len = buf + len - m;
+    memmove(buf, m, len);
+    if (cmd == 0 || len || poll(&p, 1, 0) > 0)
+      continue;
+    render_clear(r);
+    if (cmd == GFX_PICTURE && !serve_draw(r, arg)) {
+      draw_start(r, arg);
+      drawing = 1;
+    } else
+      serve_show(r, out, fmt);
+    cmd = 0;
+  }
+}
+
+#ifdef PROFILE
+/* Draw each picture from a clear screen and print what it took as CSV,
+   one line a picture */
+static void profile(void)
+{
+  struct render *r = render_new();
+  struct prof *p = &r->prof;
+  uint16_t i;
+  uint8_t n;
+  uint64_t t;
+
+  printf("picture,us");
+  for (n = 0; n < PROF_OPS; n++)
+    printf(",%s", prof_opname[n]);
+  printf(",calls,cache_hits,depth,lines,line_pixels,line_us,fills,"
+    "fill_pixels,fill_depth,fill_rescans,fill_us,gfinds,gfind_misses\n");
+  for (i = 0; i < npics; i++) {
+    render_clear(r);
+    memset(p, 0, sizeof(struct prof));
+    t = prof_now();
+    draw_picture(r, piclist[i]);
+    p->total_ns = prof_now() - t;
+    printf("%u,%.1f", piclist[i], p->total_ns / 1000.0);
+    for (n = 0; n < PROF_OPS; n++)
+      printf(",%lu", p->ops[n]);
+    printf(",%lu,%lu,%lu,%lu,%lu,%.1f,%lu,%lu,%lu,%lu,%.1f,%lu,%lu\n",
+      p->calls, p->cache_hits, p->depth, p->lines, p->line_pixels,
+      p->line_ns / 1000.0, p->fills, p->fill_pixels, p->fill_depth,
+      p->fill_rescans, p->fill_ns / 1000.0, p->gfinds, p->gfind_misses);
+  }
+  render_free(r);
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+  struct render *r;
+  struct stat st;
+  int fd;
+  int i;
+  int list = 0;
+  uint8_t fmt = FMT_PPM;
+  int multi = 0;
+  int cop = 0;
+#ifdef PROFILE
+  int prof = 0;
+#endif
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  const char *out = NULL;
+  const char *aname = NULL;
+  const char *abuild = NULL;
+
+  while ((i = getopt(argc, argv, "a:A:bf:j:lo:pPR:x:")) != -1) {
+    switch(i) {
+      case 'a':
+        aname = optarg;
+        break;
+      case 'A':
+        abuild = optarg;
+        list = 1;
+        break;
+      case 'b':
+        multi = 1;
+        break;
+      case 'f':
+        for (fmt = 0; fmtname[fmt]; fmt++)
+          if (strcmp(optarg, fmtname[fmt]) == 0)
+            break;
+        if (fmtname[fmt] == NULL)
+          error(USAGE);
+        break;
+      case 'j':
+        threads = atoi(optarg);
+        break;
+      case 'l':
+        list = 1;
+        break;
+      case 'o':
+        out = optarg;
+        break;
+      case 'p':
+        cop = 1;
+        break;
+#ifdef PROFILE
+      case 'P':
+        prof = 1;
+        list = 1;
+        break;
+#endif
+      case 'R':
+        if (sscanf(optarg, "%hux%hu", &out_w, &out_h) != 2 ||
+            out_w < 1 || out_w > 4096 || out_h < 1 || out_h > 4096)
+          error(USAGE);
+        break;
+      case 'x':
+        out_scale = atoi(optarg);
+        if (out_scale < 1 || out_scale > MAX_SCALE)
+          error(USAGE);
+        break;
+      default:
+        error(USAGE);
+    }
+  }
+  if ((out_w || out_scale > 1) && fmt == FMT_SIXEL)
+    error(USAGE);
+  if (out_w && out_scale > 1)
+    error(USAGE);
+  if (multi) {
+    if (optind >= argc || argc - optind > 3)
+      error(USAGE);
+  } else if (optind + 1 - list - cop != argc - 1)
+    error(USAGE);
+  fd = open(argv[optind], O_RDONLY);
+  if (fd == -1) {
+    perror(argv[optind]);
+    exit(1);
+  }
+  /* Mapped read only so every g9x drawing from the file shares it */
+  if (fstat(fd, &st) == -1) {
+    perror(argv[optind]);
+    exit(1);
+  }
+  if (st.st_size < 1024 || st.st_size > 0x7FFFFFFF) {
+    fprintf(stderr, "Invalid picture data.\n");
+    exit(1);
+  }
+  pictures = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (pictures == MAP_FAILED) {
+    perror(argv[optind]);
+    exit(1);
+  }
+  close(fd);
+  picsize = st.st_size;
+  gindex();
+
+#ifdef PROFILE
+  if (prof) {
+    profile();
+    return 0;
+  }
+#endif
+  if (abuild) {
+    if (out_w)
+      error(USAGE);
+    atlas_build(abuild);
+    return 0;
+  }
+  if (aname)
+    atlas_open(aname);
+  if (list) {
+    for (i = 0; i < npics; i++)
+      printf("%u\n", piclist[i]);
+    return 0;
+  }
+
+  if (multi) {
+    if (optind + 1 < argc)
+      batch_first = batch_last = atoi(argv[optind + 1]);
+    if (optind + 2 < argc)
+      batch_last = atoi(argv[optind + 2]);
+    if (out)
+      batch_dir = out;
+    batch_fmt = fmt;
+    batch(threads);
+    return 0;
+  }
+
+  if (out == NULL) {
+    static char name[16];
+    snprintf(name, sizeof(name), "out.%s", fmtname[fmt]);
+    out = name;
+  }
+  if (cop) {
+    if (strcmp(out, "-") == 0)
+      error(USAGE);
+    serve(out, fmt);
+    return 0;
+  }
+  r = render_new();
+  render_picture(r, atoi(argv[optind + 1]));
+  save_image(r, out, fmt);
+  return 0;
+}
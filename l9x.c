@@ -15,6 +15,9 @@
  * interpreter by Glen Summers et al.
  */
 
+#if defined(GAME_IMAGE) && defined(__linux__)
+#define _GNU_SOURCE	/* memfd_create */
+#endif
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -24,6 +27,24 @@
 #include <ctype.h>
 #include <time.h>
 #include <termios.h>
+#include <sys/stat.h>
+#ifdef GAME_IMAGE
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+#if defined(SNAPSHOT) || defined(GRAPHICS) || defined(METRICS) || defined(GAME_IMAGE)
+#include <errno.h>
+#endif
+#ifdef GRAPHICS
+#include <poll.h>
+#endif
+#if defined(GRAPHICS) || defined(METRICS) || defined(GAME_IMAGE)
+#include <signal.h>
+#endif
+#ifdef FUZZ
+#include <setjmp.h>
+#endif
 
 /*
  *	Defines
@@ -32,6 +53,43 @@
  *	STACKSIZE	:	Override stack size default (256)
  *	LISTSIZE	:	Override list size default (1024)
  *	TEXT_VERSION1	:	Interpreter for early stype text strings
+ *	STATISTICS	:	Count instructions, turns, paging and message
+ *			cache hits at exit
+ *	GAME_IMAGE	:	Support preprocessed game images (needs mmap)
+ *			and the -c and -d tools
+ *	VERIFY		:	Check the bytecode at load time and skip the
+ *			runtime checks it proves can't fire
+ *	SNAPSHOT	:	Keep game states in a deduplicated chunk store,
+ *			giving #undo and the -S save store
+ *	GRAPHICS	:	Draw pictures in a g9x co-process (needs fork)
+ *	METRICS		:	Keep live counters and turn times, written out on
+ *			SIGUSR1 and to the -s file
+ *	STATE_HASH	:	Track which variables and list bytes each turn
+ *			writes and keep a running hash of them all
+ *	MSG_CACHE	:	Keep the most recently printed messages decoded
+ *	MSG_CACHE_SIZE	:	Override how many by default (64)
+ *	FUZZ		:	Built into the fuzz harness: errors jump back to it
+ *			and execute() stops after fuzz_budget instructions
+ *
+ *	Options
+ *
+ *	-c image	:	Write a preprocessed image of the game (GAME_IMAGE)
+ *	-d file		:	Write every message to file, - for stdout (not
+ *				VIRTUAL_GAME)
+ *	-g pictures	:	Run g9x on the picture file to draw the pictures
+ *				the game shows (GRAPHICS)
+ *	-l log		:	Record the seed and every input line to log
+ *	-m size		:	Keep up to size decoded messages, 0 for none
+ *				(MSG_CACHE)
+ *	-L socket	:	Listen on a unix socket and fork a session for
+ *				each connection, all sharing one image
+ *				(GAME_IMAGE)
+ *	-r log		:	Replay a recorded log silently, showing only the
+ *				output of the final turn
+ *	-s file		:	Keep the counters in file, rewritten every turn
+ *				(METRICS)
+ *	-S dir		:	Save games as lists of chunks kept in dir, shared
+ *				by every save using that dir (SNAPSHOT)
  */
 
 #ifndef STACKSIZE
@@ -43,18 +101,31 @@
 
 #ifdef VIRTUAL_GAME
 
+#ifdef GAME_IMAGE
+#error "GAME_IMAGE needs the game in memory"
+#endif
+
 static uint8_t game[32];
+#define game_data game
 #define game_base ((uint8_t *)NULL)
 
 #else
 
-/* Running from memory directly */
+/* Running from memory directly, or from a mapped image */
 #define getb(x)	*(x)
-static uint8_t game[27000];
+static uint8_t game_data[27000];
+static uint8_t *game = game_data;
 #define game_base game
 
 #endif
 
+/* Text tables are walked by length, which a bad game can run off */
+#ifdef VIRTUAL_GAME
+#define game_past(p)	0
+#else
+#define game_past(p)	((p) > game_base + gamesize)
+#endif
+
 static int gamefile;
 
 static uint16_t gamesize;
@@ -85,8 +156,8 @@ static struct {
 
 uint16_t *stack = stackbase;
 
-static uint8_t *tables[16];
-static uint8_t ttype[16];
+static uint8_t *tables[33];	/* List ops can name 1-32 */
+static uint8_t ttype[33];
 
 static char buffer[80];
 static uint8_t wordbuf[3];
@@ -94,8 +165,140 @@ static uint8_t wordcount;
 
 static uint16_t seed;	/* Random numbers */
 
+static uint8_t quiet;	/* Replaying a log - output is discarded */
+static int logfd = -1;
+static int replayfd = -1;
+
 static void error(const char *p);
 
+#ifdef FUZZ
+static jmp_buf fuzz_jmp;
+static unsigned long fuzz_budget;
+#endif
+
+#if defined(STATISTICS) || defined(METRICS)
+static unsigned long insns;
+static unsigned long turns;
+static unsigned long msgs;	/* Messages printed */
+static unsigned long syscalls;	/* Game, input and output I/O */
+#define STAT(x)	((x)++)
+#define STATN(x, n)	((x) += (n))
+#else
+#define STAT(x)
+#define STATN(x, n)
+#endif
+
+#ifdef STATE_HASH
+/*
+ *	Game state tracking. Every write to a variable or list byte goes
+ *	through setvar() or poke(), which keep a running hash of the lot and
+ *	mark the slot dirty, so a fingerprint of the state each turn and the
+ *	set of things that changed cost nothing like a pass over the context.
+ *
+ *	Slots 0-255 are the variables and the lists follow. Each slot adds
+ *	in a mix of its number and value, and a zero adds nothing so a
+ *	cleared context hashes to 0. Anything that replaces the context
+ *	wholesale calls state_rehash().
+ */
+
+#define NSLOTS		(256 + LISTSIZE)
+
+static uint64_t state_hash;
+static uint64_t state_dirty[(NSLOTS + 63) / 64];
+static uint16_t state_changed;	/* Slots dirtied this turn */
+
+static uint64_t state_mix(uint16_t s, uint16_t v)
+{
+  uint64_t z = v * ((2 * s + 1) * 0x9E3779B97F4A7C15ULL);
+  z ^= z >> 30;
+  z *= 0xBF58476D1CE4E5B9ULL;
+  z ^= z >> 27;
+  z *= 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+static void state_mark(uint16_t s)
+{
+  uint64_t m = 1ULL << (s & 63);
+  if (!(state_dirty[s >> 6] & m)) {
+    state_dirty[s >> 6] |= m;
+    state_changed++;
+  }
+}
+
+static void setvar(uint8_t n, uint16_t v)
+{
+  if (variables[n] != v) {
+    state_hash ^= state_mix(n, variables[n]) ^ state_mix(n, v);
+    state_mark(n);
+    variables[n] = v;
+  }
+}
+
+/* List ops can also write into the game, which isn't state */
+static void poke(uint8_t *p, uint8_t v)
+{
+  uint16_t s;
+  if (p < lists || p >= lists + sizeof(lists))
+    *p = v;
+  else if (*p != v) {
+    s = 256 + (p - lists);
+    state_hash ^= state_mix(s, *p) ^ state_mix(s, v);
+    state_mark(s);
+    *p = v;
+  }
+}
+
+static uint64_t state_full(void)
+{
+  uint64_t h = 0;
+  uint16_t i;
+  for (i = 0; i < 256; i++)
+    h ^= state_mix(i, variables[i]);
+  for (i = 0; i < LISTSIZE; i++)
+    h ^= state_mix(256 + i, lists[i]);
+  return h;
+}
+
+/* The context was replaced, so everything counts as changed */
+static void state_rehash(void)
+{
+  state_hash = state_full();
+  memset(state_dirty, 0xFF, sizeof(state_dirty));
+  state_changed = NSLOTS;
+}
+
+#ifdef SNAPSHOT
+/* Are slots first to last all untouched this turn */
+static uint8_t state_clean(uint16_t first, uint16_t last)
+{
+  while (first <= last) {
+    if (!(first & 63) && last - first >= 63) {
+      if (state_dirty[first >> 6])
+        return 0;
+      first += 64;
+    } else if (state_dirty[first >> 6] & (1ULL << (first & 63)))
+      return 0;
+    else
+      first++;
+  }
+  return 1;
+}
+#endif
+
+/* Called as each turn asks for input, once everyone has looked */
+static void state_turn(void)
+{
+  memset(state_dirty, 0, sizeof(state_dirty));
+  state_changed = 0;
+}
+
+#else
+#define setvar(n, v)	(variables[n] = (v))
+#define poke(p, v)	(*(p) = (v))
+#define state_rehash()
+#endif
+
 /*
  *	I/O routines.
  */
@@ -131,9 +334,17 @@ static void display_exit(void)
 {
 }
 
+/* The fuzz harness wants the text decoded, not written */
+#ifdef FUZZ
+#define out_write(p, n)	do { } while(0)
+#else
+#define out_write(p, n)	write(1, (p), (n))
+#endif
+
 static void flush_word(void)
 {
-  write(1, wbuf, wbp);
+  STAT(syscalls);
+  out_write(wbuf, wbp);
   xpos += wbp;
   wbp = 0;
 }
@@ -142,8 +353,10 @@ static void char_out(char c)
 {
   if (c == '\n') {
     flush_word();
-    if (xpos)
-      write(1, "\n", 1);
+    if (xpos) {
+      STAT(syscalls);
+      out_write("\n", 1);
+    }
     xpos = 0;
     return;
   }
@@ -154,38 +367,133 @@ static void char_out(char c)
   }
   if (xpos + wbp >= cols) {
     xpos = 0;
-    write(1,"\n", 1);
+    STAT(syscalls);
+    out_write("\n", 1);
   }
   flush_word();
-  write(1," ", 1);
+  STAT(syscalls);
+  out_write(" ", 1);
   xpos++;
 }
 
 static void string_out(const char *p)
 {
+  if (quiet)
+    return;
   while(*p)
     char_out(*p++);
 }
 
-static void print_num(uint16_t v)
+static const char *numstr(uint16_t v)
 {
 #ifdef __linux__
-  char buf[9];
+  static char buf[9];
   snprintf(buf, 8, "%d", v);	/* FIXME: avoid expensive snprintf */
-  string_out(buf);
+  return buf;
 #else
-  string_out(_itoa(v));
+  return _itoa(v);
 #endif
 }
 
+static void print_num(uint16_t v)
+{
+  if (quiet)
+    return;
+  string_out(numstr(v));
+}
+
+/*
+ *	Replay logs are one input line per line of text, optionally led by
+ *	a #seed line so the random numbers come out the same.
+ */
+
+static char rbuf[256];
+static int rlen, rpos;
+
+static uint8_t replay_fill(void)
+{
+  rpos = 0;
+  STAT(syscalls);
+  rlen = read(replayfd, rbuf, sizeof(rbuf));
+  if (rlen <= 0) {
+    close(replayfd);
+    replayfd = -1;
+    rlen = 0;
+    return 0;
+  }
+  return 1;
+}
+
+static void replay_line(void)
+{
+  char *p = buffer;
+  char c;
+
+  while(rpos < rlen || replay_fill()) {
+    c = rbuf[rpos++];
+    if (c == '\n')
+      break;
+    if (p < buffer + sizeof(buffer) - 1)
+      *p++ = c;
+  }
+  *p = 0;
+  /* If that was the last line then the player gets to see this turn */
+  if (replayfd == -1 || (rpos == rlen && !replay_fill()))
+    quiet = 0;
+}
+
+/* A read can bring in several lines at once (when piped) so keep what
+   is left over for the turns after. Gives 0 at the end of the input */
+static char ibuf[256];
+static int ilen, ipos;
+
+static uint8_t input_line(void)
+{
+  char *p = buffer;
+  char c;
+
+  while(1) {
+    if (ipos == ilen) {
+      STAT(syscalls);
+      ilen = read(0, ibuf, sizeof(ibuf));
+      ipos = 0;
+      if (ilen < 0) {
+        ilen = 0;
+        error("read");
+      }
+      /* A last line without a newline still counts */
+      if (ilen == 0) {
+        *p = 0;
+        return p != buffer;
+      }
+    }
+    c = ibuf[ipos++];
+    if (c == '\n')
+      break;
+    if (p < buffer + sizeof(buffer) - 1)
+      *p++ = c;
+  }
+  *p = 0;
+  return 1;
+}
+
 static void read_line(void)
 {
-  int l = read(0, buffer, sizeof(buffer));
-  if (l < 0)
-    error("read");
-  buffer[l] = 0;
-  if (l && buffer[l-1] == '\n')
-    buffer[l-1] = 0;
+  /* Replayed lines are already in the log */
+  if (replayfd != -1) {
+    replay_line();
+    xpos = 0;
+    return;
+  }
+  /* End of input, don't spin forever (or fill the log) on empty lines */
+  if (!input_line())
+    game_over = 1;
+  /* One line is one turn, so it is logged and replayed as one */
+  if (logfd != -1 && !game_over) {
+    STATN(syscalls, 2);
+    write(logfd, buffer, strlen(buffer));
+    write(logfd, "\n", 1);
+  }
   xpos = 0;
 }
 
@@ -195,17 +503,38 @@ static void read_filename(void)
   read_line();
 }
 
+#ifndef VIRTUAL_GAME
+static int dumpfd = -1;
+static void dump_char(char c);
+#endif
+
+#ifdef MSG_CACHE
+static void mcache_rec(char c);
+#endif
+
 static void print_char(uint8_t c)
 {
   if (c == 0x25)
     c = '\n';
   else if (c == 0x5F)
     c = ' ';
+#ifdef MSG_CACHE
+  mcache_rec(c);
+#endif
+#ifndef VIRTUAL_GAME
+  if (dumpfd != -1) {
+    dump_char(c);
+    return;
+  }
+#endif
   char_out(c);
 }
 
 static void error(const char *p)
 {
+#ifdef FUZZ
+  longjmp(fuzz_jmp, 1);
+#endif
   display_exit();
   write(2, p, strlen(p));
   write(2, "\n", 1);
@@ -216,16 +545,13 @@ static void error(const char *p)
 
 #define NUM_PAGES	64		/* 16K */
 
-static uint8_t last_ah;
+static uint8_t last_ah = 0xFF;	/* Never a valid page, nothing cached yet */
 static uint8_t *last_base;
 
-#ifdef STATISTICS
+#if defined(STATISTICS) || defined(METRICS)
 static unsigned long slow;
 static unsigned long miss;
 static unsigned long fast;
-#define STAT(x)	((x)++)
-#else
-#define STAT(x)
 #endif
 
 static uint8_t page_cache[NUM_PAGES][256];
@@ -259,6 +585,7 @@ static void page_load(uint8_t slot, uint8_t ah)
 {
 	page_addr[slot] = ah;
 	page_pri[slot] = 0x80;
+	STATN(syscalls, 2);
 	/* Caution - last page is not packed so a short read isn't
 	   always an error */
 	if (lseek(gamefile, (ah << 8), SEEK_SET) < 0 ||
@@ -289,7 +616,7 @@ static uint8_t page_find(uint8_t ah)
 
 static uint8_t getb(uint8_t *p)
 {
-	uint16_t addr = (uint16_t)p;
+	uint16_t addr = (uint16_t)(uintptr_t)p;
 	uint8_t ah = addr >> 8;
 	uint8_t c;
 
@@ -317,45 +644,82 @@ static uint8_t getb(uint8_t *p)
 /* FIXME: for version 2 games they swapped the 1 markers for length bytes
    with an odd hack where a 0 length means 255 + nextbyte (unless 0 if so
    repeat */
-static void decompress(uint8_t *p, uint16_t m)
+
+static void print_word(uint8_t n);
+
+/* Walk the table looking for 1 bytes and counting off our input */
+static uint8_t *msgskip(uint8_t *p, uint16_t m)
 {
-  uint8_t d;
-  /* Walk the table looking for 1 bytes and counting off our
-     input */
   while(m--)
-    while(getb(p++) != 1);
-  while((d = getb(p++)) > 2) {
+    do {
+      if (game_past(p + 1))
+        error("BADM");
+    } while(getb(p++) != 1);
+  return p;
+}
+
+/* Nothing says where a message ends but its terminator */
+static void msgout(uint8_t *p)
+{
+  uint8_t d;
+  while(1) {
+    if (game_past(p + 1))
+      error("BADM");
+    if ((d = getb(p++)) <= 2)
+      return;
     if (d < 0x5E)
       print_char(d + 0x1d);
     else
-      decompress(worddict, d - 0x5E);
+      print_word(d - 0x5E);
   }
 }
+
+#define worddict_base	worddict
+#define word_msg(n)	(n)
+#define msgnext(p)	msgskip((p), 1)
+#define FIRST_MSG	0
+#define TEXT_V1		1
+
 #else
 
+static void print_word(uint8_t n);
+
 static uint8_t *msglen(uint8_t *p, uint16_t *l)
 {
   *l = 0;
-  while(!getb(p)) {
+  while(!game_past(p + 1) && !getb(p)) {
     *l += 255;
     p++;
   }
+  if (game_past(p + 1))
+    error("BADM");
   *l += getb(p++);
+  /* Enough 0 bytes wrap the length, and 0 would walk us backwards */
+  if (*l == 0)
+    error("BADM");
   return p;
 }
-  
-static void decompress(uint8_t *p, uint16_t m)
+
+/* Walk the table skipping messages. Messages count from 1 */
+static uint8_t *msgskip(uint8_t *p, uint16_t m)
 {
-  uint8_t d;
   uint16_t l;
-  /* Walk the table skipping messages */
-  if (m == 0)
-    return;
   while(--m) {
     p = msglen(p, &l);
     p += l - 1;
+    if (game_past(p))
+      error("BADM");
   }
+  return p;
+}
+
+static void msgout(uint8_t *p)
+{
+  uint8_t d;
+  uint16_t l;
   p = msglen(p, &l);
+  if (game_past(p + l - 1))
+    error("BADM");
   /* A 1 byte message means its 0 text chars long */
   while(--l) {
     d = getb(p++);
@@ -364,14 +728,243 @@ static void decompress(uint8_t *p, uint16_t m)
     if (d < 0x5E)
       print_char(d + 0x1d);
     else
-      decompress(worddict - 1, d - 0x5d);
+      print_word(d - 0x5E);
+  }
+}
+
+#define worddict_base	(worddict - 1)
+#define word_msg(n)	((n) + 1)
+#define msgnext(p)	msgskip((p), 2)
+#define FIRST_MSG	1
+#define TEXT_V1		0
+
+#endif
+
+#ifndef VIRTUAL_GAME
+/* The word dictionary index, from an image or made for a dump */
+static uint16_t *dictidx;
+static uint16_t ndict;
+#endif
+#ifdef GAME_IMAGE
+/* Indexes, present when running from a preprocessed image */
+static uint16_t *msgidx;
+static uint16_t *wordidx;
+static uint16_t *wordstart;
+static uint16_t *exitidx;
+static uint16_t nmsg;
+static uint16_t nword;
+static uint16_t nloc;
+#endif
+
+/* Words can be made of words, but not forever */
+#define WORD_DEPTH	8
+static uint8_t word_depth;
+
+static void print_word(uint8_t n)
+{
+  if (word_depth == WORD_DEPTH)
+    error("word loop");
+  word_depth++;
+#ifndef VIRTUAL_GAME
+  if (n < ndict)
+    msgout(game_base + dictidx[n]);
+  else
+#endif
+  msgout(msgskip(worddict_base, word_msg(n)));
+  word_depth--;
+}
+
+#ifdef MSG_CACHE
+/*
+ *	Decoded message cache. Room descriptions and the stock replies are
+ *	printed over and over, and each time means finding the message and
+ *	expanding every dictionary word in it (paging it all in when the
+ *	game is virtual). The last few messages printed are kept as the
+ *	text they came out as and the least recently used one goes when it
+ *	is full. Messages too long to keep are just decoded every time.
+ */
+
+#ifndef MSG_CACHE_SIZE
+#define MSG_CACHE_SIZE	64
+#endif
+#define MSG_CACHE_MAX	1024	/* Characters */
+
+struct mcache {
+  uint16_t msg;
+  uint16_t len;
+  uint16_t size;	/* Allocated for text */
+  uint16_t newer;	/* Use order, index + 1, 0 is the end */
+  uint16_t older;
+  uint16_t next;	/* Hash chain, index + 1 */
+  char *text;
+};
+
+static struct mcache *mcache;
+static uint16_t *mcache_head;	/* Index + 1, 0 is empty */
+static uint16_t mcache_size = MSG_CACHE_SIZE;
+static uint16_t mcache_used;
+static uint16_t mcache_newest;
+static uint16_t mcache_oldest;
+
+static char mrec[MSG_CACHE_MAX];
+static uint16_t mrec_len;
+static uint8_t mrec_on;
+
+#if defined(STATISTICS) || defined(METRICS)
+static unsigned long mhits;
+static unsigned long mmisses;
+#endif
+
+static void mcache_init(void)
+{
+  if (mcache_size == 0)
+    return;
+  mcache = calloc(mcache_size, sizeof(struct mcache));
+  mcache_head = calloc(mcache_size, sizeof(uint16_t));
+  if (mcache == NULL || mcache_head == NULL)
+    error("l9x: out of memory\n");
+}
+
+/* Forget everything, for when the messages themselves change */
+static void mcache_flush(void)
+{
+  if (mcache) {
+    memset(mcache_head, 0, mcache_size * sizeof(uint16_t));
+    mcache_used = mcache_newest = mcache_oldest = 0;
+  }
+}
+
+static void mcache_unlink(uint16_t i)
+{
+  struct mcache *c = mcache + i - 1;
+  if (c->newer)
+    mcache[c->newer - 1].older = c->older;
+  else
+    mcache_newest = c->older;
+  if (c->older)
+    mcache[c->older - 1].newer = c->newer;
+  else
+    mcache_oldest = c->newer;
+}
+
+static void mcache_front(uint16_t i)
+{
+  struct mcache *c = mcache + i - 1;
+  c->newer = 0;
+  c->older = mcache_newest;
+  if (mcache_newest)
+    mcache[mcache_newest - 1].newer = i;
+  else
+    mcache_oldest = i;
+  mcache_newest = i;
+}
+
+/* Print a message we have, giving 0 if we don't */
+static uint8_t mcache_print(uint16_t m)
+{
+  uint16_t i = mcache_head[m % mcache_size];
+  struct mcache *c;
+  char *p, *e;
+
+  while (i && mcache[i - 1].msg != m)
+    i = mcache[i - 1].next;
+  if (i == 0) {
+    STAT(mmisses);
+    return 0;
+  }
+  STAT(mhits);
+  c = mcache + i - 1;
+  if (mcache_newest != i) {
+    mcache_unlink(i);
+    mcache_front(i);
+  }
+  p = c->text;
+  e = p + c->len;
+  while (p < e)
+    char_out(*p++);
+  return 1;
+}
+
+static void mcache_rec(char c)
+{
+  if (!mrec_on)
+    return;
+  if (mrec_len == MSG_CACHE_MAX)
+    mrec_on = 0;
+  else
+    mrec[mrec_len++] = c;
+}
+
+/* Keep what message m just printed, if it wasn't too long */
+static void mcache_add(uint16_t m)
+{
+  struct mcache *c;
+  uint16_t i;
+  uint16_t *n;
+
+  if (!mrec_on)
+    return;
+  mrec_on = 0;
+  if (mcache_used < mcache_size)
+    i = ++mcache_used;
+  else {
+    /* Reuse the least recently used */
+    i = mcache_oldest;
+    mcache_unlink(i);
+    n = mcache_head + mcache[i - 1].msg % mcache_size;
+    while (*n != i)
+      n = &mcache[*n - 1].next;
+    *n = mcache[i - 1].next;
+  }
+  c = mcache + i - 1;
+  if (c->size < mrec_len) {
+    free(c->text);
+    c->size = 0;
+    c->text = malloc(mrec_len);
+    if (c->text == NULL)
+      error("l9x: out of memory\n");
+    c->size = mrec_len;
   }
+  if (mrec_len)
+    memcpy(c->text, mrec, mrec_len);
+  c->msg = m;
+  c->len = mrec_len;
+  c->next = mcache_head[m % mcache_size];
+  mcache_head[m % mcache_size] = i;
+  mcache_front(i);
 }
 #endif
 
 static void print_message(uint16_t m)
 {
-  decompress(messages, m);
+  uint8_t *p;
+
+  if (quiet)
+    return;
+#ifndef TEXT_VERSION1
+  if (m == 0)
+    return;
+#endif
+  STAT(msgs);
+#ifdef MSG_CACHE
+  mrec_on = 0;
+  if (mcache_size) {
+    if (mcache_print(m))
+      return;
+    mrec_len = 0;
+    mrec_on = 1;
+  }
+#endif
+#ifdef GAME_IMAGE
+  if (m < nmsg)
+    p = game_base + msgidx[m];
+  else
+#endif
+  p = msgskip(messages, m);
+  msgout(p);
+#ifdef MSG_CACHE
+  mcache_add(m);
+#endif
 }
 
 /*
@@ -393,10 +986,18 @@ static void lookup_exit(void)
   uint8_t v;
   uint8_t ls = l;
 
+#ifdef GAME_IMAGE
+  if (l && l <= nloc) {
+    p = game_base + exitidx[l];
+    l = 1;	/* Nothing left to skip */
+  }
+#endif
   /* Scan through the table finding 0x80 end markers */
   l--;		/* No entry 0 */
   while (l--) {
     do {
+      if (game_past(p + 2))
+        error("BADX");
       v = getb(p);
       p += 2;
     } while (!(v & 0x80));
@@ -405,10 +1006,12 @@ static void lookup_exit(void)
   /* Basically each entry is a word in the form
      [Last.1][BiDir.1][Flags.2][Exit.4][Target.8] */
   do {
+    if (game_past(p + 2))
+      error("BADX");
     v = getb(p);
     if ((v & 0x0F) == d) {
-      variables[getb(pc++)] = ((getb(p++)) >> 4) & 7;	/* Flag bits */
-      variables[getb(pc++)] = getb(p++);
+      setvar(getb(pc++), ((getb(p++)) >> 4) & 7);	/* Flag bits */
+      setvar(getb(pc++), getb(p++));
       return;
     }
     p+=2;
@@ -420,18 +1023,20 @@ static void lookup_exit(void)
     p = exitmap;
     l = 1;
     do {
+      if (game_past(p + 3))
+        error("BADX");
       v = getb(p++);
       if (getb(p++) == ls && ((v & 0x1f) == d)) {
-        variables[getb(pc++)] = (v >> 4) & 7;
-        variables[getb(pc++)] = l;
+        setvar(getb(pc++), (v >> 4) & 7);
+        setvar(getb(pc++), l);
         return;
       }
       if (v & 0x80)
         l++;
     } while(getb(p));
   }
-  variables[getb(pc++)] = 0;
-  variables[getb(pc++)] = 0;
+  setvar(getb(pc++), 0);
+  setvar(getb(pc++), 0);
 }
 
 static uint8_t wordcmp(char *s, uint8_t *p, uint8_t *v)
@@ -448,6 +1053,19 @@ static uint8_t matchword(char *s)
 {
   uint8_t *p = dictionary;
   uint8_t v;
+#ifdef GAME_IMAGE
+  uint16_t i;
+  int c = toupper(*s);
+
+  /* Only words with the same first letter can match and the index keeps
+     them in dictionary order, so the first hit is the right one */
+  if (nword && c > 0 && c < 0x80) {
+    for (i = wordstart[c]; i < wordstart[c + 1]; i++)
+      if (wordcmp(s, game_base + wordidx[i], &v) == 1)
+        return v;
+    return 0xFF;
+  }
+#endif
   
   do {
 /*    outword(p); */
@@ -463,52 +1081,647 @@ static uint8_t matchword(char *s)
   return 0xFF;
 }
 
-static void do_input(void)
-{
-  uint8_t *w = wordbuf;
-  char *p = buffer;
-  char *s;
+#ifdef SNAPSHOT
+/*
+ *	Snapshot store. A snapshot is the context cut into fixed chunks and
+ *	each chunk is kept once however many snapshots use it, found by a
+ *	hash of its contents and freed when the last user goes. Most of the
+ *	context doesn't change from turn to turn so a long undo history (or
+ *	a pile of saves) costs little more than the chunks that differ.
+ *
+ *	On disc the chunks live in the -S directory named by their hash and
+ *	a save is just the list of hashes. Chunk files are never removed as
+ *	another save (or another player) may be using them.
+ */
 
-  wordcount = 0;
-  read_line();
+#define CHUNK_SIZE	256
+#define NCHUNKS		((sizeof(context) + CHUNK_SIZE - 1) / CHUNK_SIZE)
+#define SNAP_CHUNKS	512		/* 128K */
+#define UNDO_DEPTH	32
+#define NO_CHUNK	0xFFFF
+
+struct chunk {
+  uint64_t hash;
+  uint16_t refs;
+  uint16_t next;	/* Hash chain or free list, index + 1 */
+  uint8_t data[CHUNK_SIZE];
+};
 
-  while(*p) {
-    while (isspace(*p))
-      p++;
-    /* Now at word start */
-    wordcount++;
-    /* Check - do we count unknown words */
-    s = p;
-    while(*p && !isspace(*p))
-      p++;
-    /* The text between s and p-1 is now the word */
-    *p++ = 0;
-    if (w < wordbuf + sizeof(wordbuf))
-      *w++ = matchword(s);
-  }
+static struct chunk chunks[SNAP_CHUNKS];
+static uint16_t chunk_head[SNAP_CHUNKS];	/* Index + 1, 0 is empty */
+static uint16_t chunk_free;
+static uint16_t chunk_top;
 
-  /* Finally put the first 3 words and the count into variables */
-  w = wordbuf;
-  variables[getb(pc++)] = *w++;
-  variables[getb(pc++)] = *w++;
-  variables[getb(pc++)] = *w++;
-  variables[getb(pc++)] = wordcount;
-}
+static uint8_t snapbuf[NCHUNKS * CHUNK_SIZE];
 
-/* This is fairly mindless but will do for now */
-static uint16_t hash(void)
+static uint16_t undo[UNDO_DEPTH][NCHUNKS];
+static uint8_t undo_base;
+static uint8_t undo_count;
+
+static const char *storedir;
+
+static uint64_t chunk_hash(const uint8_t *p)
 {
-  uint8_t h = 0;
-  uint8_t *gp = game;
-  while(gp < game + 32)
-    h += *gp++;
+  uint64_t h = 0xCBF29CE484222325ULL;
+  uint16_t i;
+  for (i = 0; i < CHUNK_SIZE; i++) {
+    h ^= *p++;
+    h *= 0x100000001B3ULL;
+  }
   return h;
 }
 
-static char savefail[] = "Save failed\n";
-static char loadfail[] = "Load failed\n";
+static uint16_t chunk_find(uint64_t h, const uint8_t *p)
+{
+  uint16_t i = chunk_head[h % SNAP_CHUNKS];
+  while(i) {
+    struct chunk *c = chunks + i - 1;
+    if (c->hash == h && (p == NULL || memcmp(c->data, p, CHUNK_SIZE) == 0))
+      return i - 1;
+    i = c->next;
+  }
+  return NO_CHUNK;
+}
 
-static void save_game(void)
+/* Take a reference to the chunk holding p, adding it if need be */
+static uint16_t chunk_get(const uint8_t *p)
+{
+  uint64_t h = chunk_hash(p);
+  uint16_t i = chunk_find(h, p);
+  struct chunk *c;
+
+  if (i == NO_CHUNK) {
+    if (chunk_free) {
+      i = chunk_free - 1;
+      chunk_free = chunks[i].next;
+    } else if (chunk_top < SNAP_CHUNKS)
+      i = chunk_top++;
+    else
+      return NO_CHUNK;
+    c = chunks + i;
+    c->hash = h;
+    c->refs = 0;
+    memcpy(c->data, p, CHUNK_SIZE);
+    c->next = chunk_head[h % SNAP_CHUNKS];
+    chunk_head[h % SNAP_CHUNKS] = i + 1;
+  }
+  chunks[i].refs++;
+  return i;
+}
+
+static void chunk_put(uint16_t i)
+{
+  struct chunk *c = chunks + i;
+  uint16_t *n;
+
+  if (--c->refs)
+    return;
+  n = chunk_head + c->hash % SNAP_CHUNKS;
+  while(*n != i + 1)
+    n = &chunks[*n - 1].next;
+  *n = c->next;
+  c->next = chunk_free;
+  chunk_free = i + 1;
+}
+
+static void snap_release(uint16_t *s)
+{
+  uint8_t i;
+  for (i = 0; i < NCHUNKS; i++)
+    chunk_put(s[i]);
+}
+
+static void undo_drop_oldest(void)
+{
+  snap_release(undo[undo_base]);
+  undo_base = (undo_base + 1) % UNDO_DEPTH;
+  undo_count--;
+}
+
+#ifdef STATE_HASH
+/* A chunk wholly within the variables and lists that nothing wrote since
+   the last turn's snapshot is the same chunk as that one had */
+static uint8_t snap_clean(uint8_t i)
+{
+  uint16_t v = (uint8_t *)variables - (uint8_t *)&context;
+  uint16_t o = i * CHUNK_SIZE;
+  uint16_t e = o + CHUNK_SIZE - 1;
+
+  if (o < v)
+    return 0;
+  if (e >= sizeof(context))
+    e = sizeof(context) - 1;
+  o -= v;
+  e -= v;
+  /* Two bytes a variable then one a list byte */
+  return state_clean(o < 512 ? o / 2 : o - 256, e < 512 ? e / 2 : e - 256);
+}
+#endif
+
+/* Store the context. The dead part of the stack is cleared first so it
+   doesn't stop otherwise identical states sharing chunks. Given the last
+   turn's snapshot the chunks that can't have changed are shared as they
+   are */
+static uint8_t snap_take(uint16_t *s, uint16_t *prev)
+{
+  uint8_t i;
+
+  context.c_pc = pc - pcbase;
+  context.c_sp = stack - stackbase;
+  memset(stack, 0, (stackbase + STACKSIZE - stack) * sizeof(*stack));
+  memcpy(snapbuf, &context, sizeof(context));
+  for (i = 0; i < NCHUNKS; i++) {
+    s[i] = NO_CHUNK;
+#ifdef STATE_HASH
+    if (prev && snap_clean(i)) {
+      s[i] = prev[i];
+      chunks[s[i]].refs++;
+    }
+#endif
+  }
+  for (i = 0; i < NCHUNKS; i++) {
+    if (s[i] != NO_CHUNK)
+      continue;
+    /* When the store is full give up the oldest undo history */
+    while((s[i] = chunk_get(snapbuf + i * CHUNK_SIZE)) == NO_CHUNK) {
+      if (undo_count == 0) {
+        for (i = 0; i < NCHUNKS; i++)
+          if (s[i] != NO_CHUNK)
+            chunk_put(s[i]);
+        return 0;
+      }
+      undo_drop_oldest();
+    }
+  }
+  return 1;
+}
+
+static void snap_restore(uint16_t *s)
+{
+  uint8_t i;
+  for (i = 0; i < NCHUNKS; i++)
+    memcpy(snapbuf + i * CHUNK_SIZE, chunks[s[i]].data, CHUNK_SIZE);
+  memcpy(&context, snapbuf, sizeof(context));
+  pc = pcbase + context.c_pc;
+  stack = stackbase + context.c_sp;
+  state_rehash();
+}
+
+static uint8_t undo_last;	/* The top snapshot is from the last turn */
+
+/* Called as each turn asks for input, with pc on the input opcode */
+static void undo_push(void)
+{
+  uint16_t *prev = NULL;
+
+  if (undo_count && undo_last)
+    prev = undo[(undo_base + undo_count - 1) % UNDO_DEPTH];
+  if (undo_count == UNDO_DEPTH)
+    undo_drop_oldest();
+  undo_last = snap_take(undo[(undo_base + undo_count) % UNDO_DEPTH], prev);
+  if (undo_last)
+    undo_count++;
+}
+
+static uint16_t *undo_top(void)
+{
+  return undo[(undo_base + undo_count - 1) % UNDO_DEPTH];
+}
+
+/* Go back to the input of the turn before and ask again. That input
+   opcode takes its snapshot afresh so it comes off the history too */
+static void undo_turn(void)
+{
+  if (undo_count > 1) {
+    snap_release(undo_top());
+    undo_count--;
+  } else
+    string_out("Can't undo.\n");
+  if (undo_count) {
+    snap_restore(undo_top());
+    snap_release(undo_top());
+    undo_count--;
+  } else
+    pc--;
+}
+
+static char *chunk_name(uint64_t h)
+{
+  static char name[512];
+  static const char hex[] = "0123456789abcdef";
+  char *p;
+  int8_t i;
+
+  snprintf(name, sizeof(name) - 17, "%s/", storedir);
+  p = name + strlen(name);
+  for (i = 60; i >= 0; i -= 4)
+    *p++ = hex[(h >> i) & 15];
+  *p = 0;
+  return name;
+}
+
+/* Chunks are written to a temporary and renamed so a reader never sees
+   half of one. If it is already there then someone else wrote it */
+static uint8_t chunk_write(struct chunk *c)
+{
+  char tmp[540];
+  char *name = chunk_name(c->hash);
+  int fd;
+
+  if (access(name, F_OK) == 0)
+    return 1;
+  snprintf(tmp, sizeof(tmp), "%s.%d", name, (int)getpid());
+  fd = open(tmp, O_WRONLY|O_CREAT|O_EXCL, 0600);
+  if (fd == -1)
+    return errno == EEXIST;
+  if (write(fd, c->data, CHUNK_SIZE) != CHUNK_SIZE ||
+      close(fd) || rename(tmp, name)) {
+    unlink(tmp);
+    return 0;
+  }
+  return 1;
+}
+
+static uint8_t chunk_read(uint64_t h, uint8_t *p)
+{
+  uint16_t i = chunk_find(h, NULL);
+  int fd;
+  int r;
+
+  if (i != NO_CHUNK) {
+    memcpy(p, chunks[i].data, CHUNK_SIZE);
+    return 1;
+  }
+  fd = open(chunk_name(h), O_RDONLY);
+  if (fd == -1)
+    return 0;
+  r = read(fd, p, CHUNK_SIZE);
+  close(fd);
+  return r == CHUNK_SIZE && chunk_hash(p) == h;
+}
+
+#define SNAP_MAGIC	"L9XS"
+
+static uint8_t snap_save(int fd)
+{
+  uint16_t s[NCHUNKS];
+  uint64_t h[NCHUNKS];
+  uint8_t i;
+  uint8_t ok = 1;
+
+  if (!snap_take(s, NULL))
+    return 0;
+  for (i = 0; i < NCHUNKS; i++) {
+    h[i] = chunks[s[i]].hash;
+    ok &= chunk_write(chunks + s[i]);
+  }
+  snap_release(s);
+  return ok && write(fd, SNAP_MAGIC, 4) == 4 &&
+    write(fd, h, sizeof(h)) == sizeof(h);
+}
+
+/* Leaves the context in snapbuf for the caller to check */
+static uint8_t snap_load(int fd)
+{
+  uint64_t h[NCHUNKS];
+  uint8_t i;
+
+  if (read(fd, h, sizeof(h)) != sizeof(h))
+    return 0;
+  for (i = 0; i < NCHUNKS; i++)
+    if (!chunk_read(h[i], snapbuf + i * CHUNK_SIZE))
+      return 0;
+  return 1;
+}
+#endif
+
+#ifdef GRAPHICS
+/*
+ *	Pictures are drawn by g9x running as a co-process (g9x -p, named by
+ *	$G9X if it isn't on the path) so the game never waits for them. We
+ *	send it three byte commands, a command and a 16bit argument, which
+ *	must match g9x.c. They are small enough to go down the pipe whole,
+ *	and the pipe doesn't block: if g9x is so far behind that it is full
+ *	we keep the latest picture and send it later, as g9x only draws the
+ *	latest one it has anyway. A graphics mode switch waits for g9x to
+ *	say it has caught up so the two agree on what is showing. If g9x
+ *	goes away the game carries on without pictures.
+ */
+
+#define GFX_MODE	'M'
+#define GFX_CLEAR	'C'
+#define GFX_PICTURE	'P'
+#define GFX_ACK		'A'
+#define GFX_WAIT	2000	/* ms to wait for an acknowledgement */
+
+static const char *picname;
+static int gfx_fd = -1;
+static int gfx_ack = -1;
+static uint8_t gfx_mode;	/* What the game asked for */
+static uint8_t gfx_sent;	/* What g9x was last told */
+static uint8_t gfx_cmd;		/* Latest command not yet sent, or 0 */
+static uint16_t gfx_arg;
+
+static void gfx_start(void)
+{
+  int cmd[2], ack[2];
+  const char *g9x = getenv("G9X");
+
+  if (pipe(cmd) || pipe(ack)) {
+    perror("pipe");
+    exit(1);
+  }
+  switch(fork()) {
+    case -1:
+      perror("fork");
+      exit(1);
+    case 0:
+      dup2(cmd[0], 0);
+      dup2(ack[1], 1);
+      close(cmd[0]);
+      close(cmd[1]);
+      close(ack[0]);
+      close(ack[1]);
+      execlp(g9x ? g9x : "g9x", "g9x", "-p", picname, (char *)NULL);
+      perror("g9x");
+      _exit(127);
+  }
+  close(cmd[0]);
+  close(ack[1]);
+  gfx_fd = cmd[1];
+  gfx_ack = ack[0];
+  fcntl(gfx_fd, F_SETFL, O_NONBLOCK);
+  signal(SIGPIPE, SIG_IGN);
+}
+
+static void gfx_stop(void)
+{
+  if (gfx_fd == -1)
+    return;
+  close(gfx_fd);
+  close(gfx_ack);
+  gfx_fd = -1;
+  gfx_ack = -1;
+}
+
+/* 1 sent, 0 the pipe is full */
+static uint8_t gfx_send(uint8_t cmd, uint16_t arg)
+{
+  uint8_t m[3];
+  int l;
+
+  m[0] = cmd;
+  m[1] = arg & 0xFF;
+  m[2] = arg >> 8;
+  STAT(syscalls);
+  l = write(gfx_fd, m, 3);
+  if (l == 3)
+    return 1;
+  if (l == -1 && errno == EAGAIN)
+    return 0;
+  gfx_stop();
+  return 1;
+}
+
+static uint8_t gfx_wait(int fd, short ev)
+{
+  struct pollfd p;
+  int r;
+
+  p.fd = fd;
+  p.events = ev;
+  /* A signal (SIGUSR1 for the counters) isn't a timeout */
+  while ((r = poll(&p, 1, GFX_WAIT)) == -1 && errno == EINTR);
+  return r == 1;
+}
+
+/* Mode switches wait for room in the pipe and for g9x to answer */
+static void gfx_switch(void)
+{
+  uint8_t c = 0;
+
+  while (!gfx_send(GFX_MODE, gfx_mode))
+    if (!gfx_wait(gfx_fd, POLLOUT))
+      break;
+  if (gfx_fd == -1 || !gfx_wait(gfx_ack, POLLIN) ||
+      read(gfx_ack, &c, 1) != 1 || c != GFX_ACK) {
+    gfx_stop();
+    return;
+  }
+  gfx_sent = gfx_mode;
+}
+
+/* Bring g9x up to date. Replays are silent so nothing goes until the
+   player gets to see the turn */
+static void gfx_flush(void)
+{
+  if (gfx_fd == -1 || quiet)
+    return;
+  if (gfx_sent != gfx_mode)
+    gfx_switch();
+  if (gfx_fd != -1 && gfx_cmd && gfx_send(gfx_cmd, gfx_arg))
+    gfx_cmd = 0;
+}
+
+static void gfx_screen(uint8_t mode)
+{
+  /* Anything queued belonged to the old mode */
+  gfx_mode = mode;
+  gfx_cmd = 0;
+  gfx_flush();
+}
+
+/* A new picture or a clear replaces anything not yet sent */
+static void gfx_draw(uint8_t cmd, uint16_t arg)
+{
+  gfx_cmd = cmd;
+  gfx_arg = arg;
+  gfx_flush();
+}
+#endif
+
+#ifdef METRICS
+/*
+ *	Live counters. SIGUSR1 writes them to the -s file, or stderr without
+ *	one, and the file is also rewritten at the end of every turn. A turn
+ *	is timed from its input line arriving to the game asking for the
+ *	next one. The writer runs in the signal handler so it only uses
+ *	write() and friends and formats the numbers itself.
+ */
+
+static int statsfd = -1;
+static uint64_t turn_start;	/* 0 until the first line arrives */
+static uint64_t turn_last;
+static uint64_t turn_max;
+static uint64_t turn_total;
+
+static uint64_t metrics_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static char *metrics_put(char *p, const char *name, uint64_t v)
+{
+  char n[20];
+  uint8_t i = 0;
+
+  while (*name)
+    *p++ = *name++;
+  *p++ = ' ';
+  do {
+    n[i++] = '0' + v % 10;
+    v /= 10;
+  } while (v);
+  while (i)
+    *p++ = n[--i];
+  *p++ = '\n';
+  return p;
+}
+
+static void metrics_write(int fd)
+{
+  char buf[512];
+  char *p = buf;
+
+  p = metrics_put(p, "instructions", insns);
+  p = metrics_put(p, "turns", turns);
+  p = metrics_put(p, "messages", msgs);
+  p = metrics_put(p, "syscalls", syscalls);
+  p = metrics_put(p, "turn_us", turn_last);
+  p = metrics_put(p, "turn_us_max", turn_max);
+  p = metrics_put(p, "turn_us_total", turn_total);
+#ifdef VIRTUAL_GAME
+  p = metrics_put(p, "page_fast", fast);
+  p = metrics_put(p, "page_hit", slow);
+  p = metrics_put(p, "page_miss", miss);
+#endif
+#ifdef MSG_CACHE
+  p = metrics_put(p, "msg_cache_hits", mhits);
+  p = metrics_put(p, "msg_cache_misses", mmisses);
+#endif
+#ifdef STATE_HASH
+  p = metrics_put(p, "state_hash", state_hash);
+  p = metrics_put(p, "state_changed", state_changed);
+#endif
+  /* The file is rewritten in place so it is never seen empty */
+  if (fd == statsfd) {
+    if (pwrite(fd, buf, p - buf, 0) == p - buf)
+      ftruncate(fd, p - buf);
+  } else
+    write(fd, buf, p - buf);
+}
+
+static void metrics_signal(int sig)
+{
+  int e = errno;
+  metrics_write(statsfd != -1 ? statsfd : 2);
+  errno = e;
+}
+
+static void metrics_start(const char *name)
+{
+  struct sigaction sa;
+
+  if (name) {
+    statsfd = open(name, O_WRONLY|O_CREAT, 0644);
+    if (statsfd == -1) {
+      perror(name);
+      exit(1);
+    }
+  }
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = metrics_signal;
+  /* Don't break the input read */
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR1, &sa, NULL);
+}
+
+static void metrics_turn(void)
+{
+  if (turn_start) {
+    turn_last = metrics_now() - turn_start;
+    turn_total += turn_last;
+    if (turn_last > turn_max)
+      turn_max = turn_last;
+  }
+  if (statsfd != -1)
+    metrics_write(statsfd);
+}
+#endif
+
+static void do_input(void)
+{
+  uint8_t *w = wordbuf;
+  char *p = buffer;
+  char *s;
+
+  wordcount = 0;
+  STAT(turns);
+#ifdef METRICS
+  metrics_turn();
+#endif
+#ifdef GRAPHICS
+  gfx_flush();
+#endif
+#ifdef SNAPSHOT
+  pc--;
+  undo_push();
+  pc++;
+#endif
+#ifdef STATE_HASH
+  state_turn();
+#endif
+  read_line();
+#ifdef METRICS
+  turn_start = metrics_now();
+#endif
+#ifdef SNAPSHOT
+  if (strcmp(buffer, "#undo") == 0) {
+    undo_turn();
+    return;
+  }
+#endif
+
+  while(*p) {
+    while (isspace(*p))
+      p++;
+    /* Now at word start */
+    wordcount++;
+    /* Check - do we count unknown words */
+    s = p;
+    while(*p && !isspace(*p))
+      p++;
+    /* The text between s and p-1 is now the word */
+    *p++ = 0;
+    if (w < wordbuf + sizeof(wordbuf))
+      *w++ = matchword(s);
+  }
+
+  /* Finally put the first 3 words and the count into variables */
+  w = wordbuf;
+  setvar(getb(pc++), *w++);
+  setvar(getb(pc++), *w++);
+  setvar(getb(pc++), *w++);
+  setvar(getb(pc++), wordcount);
+}
+
+/* This is fairly mindless but will do for now */
+static uint16_t hash(void)
+{
+  uint8_t h = 0;
+  uint8_t *gp = game;
+  while(gp < game + 32)
+    h += *gp++;
+  return h;
+}
+
+static char savefail[] = "Save failed\n";
+static char loadfail[] = "Load failed\n";
+
+static void save_game(void)
 {
   int fd;
   read_filename();
@@ -522,11 +1735,41 @@ static void save_game(void)
   context.c_pc = pc - pcbase;
   context.c_sp = stack - stackbase;
   context.c_hash = hash();
+#ifdef SNAPSHOT
+  if (storedir) {
+    if (!snap_save(fd))
+      string_out(savefail);
+    close(fd);
+    return;
+  }
+#endif
   if (write(fd, &context, sizeof(context)) != sizeof(context))
     string_out(savefail);
   close(fd);
 }
 
+#ifdef VERIFY
+static uint8_t stack_ok;
+static uint8_t lsafe[33];
+#endif
+
+/* Saves from a store start with its magic, anything else is a plain
+   copy of the context */
+static uint8_t load_context(int fd)
+{
+#ifdef SNAPSHOT
+  char magic[4];
+  if (read(fd, magic, 4) == 4 && memcmp(magic, SNAP_MAGIC, 4) == 0) {
+    if (!snap_load(fd))
+      return 0;
+    memcpy(&context, snapbuf, sizeof(context));
+    return 1;
+  }
+  lseek(fd, 0, SEEK_SET);
+#endif
+  return read(fd, &context, sizeof(context)) == sizeof(context);
+}
+
 static void load_game(void)
 {
   int fd;
@@ -539,16 +1782,27 @@ static void load_game(void)
     string_out(loadfail);
     return;
   }
-  if (read(fd, &context, sizeof(context)) != sizeof(context) ||
-      context.c_hash != hash()) {
+  if (!load_context(fd) || context.c_hash != hash()) {
     string_out(loadfail);
     memset(lists, 0, sizeof(lists));
     memset(variables, 0, sizeof(variables));
     pc = pcbase;
+  } else if (context.c_sp > STACKSIZE ||
+             context.c_pc >= game_base + gamesize - pcbase) {
+    string_out(loadfail);
+    stack = stackbase;
+    pc = pcbase;
   } else {
     pc = pcbase + context.c_pc;
     stack = stackbase + context.c_sp;
   }
+#ifdef VERIFY
+  /* The verifier knows nothing about the stack we just loaded, and a
+     save can resume anywhere, even part way through an instruction */
+  stack_ok = 0;
+  memset(lsafe, 0, sizeof(lsafe));
+#endif
+  state_rehash();
   close(fd);
 }
 
@@ -567,50 +1821,313 @@ static uint16_t constant(void)
   return r;
 }
 
+/* Anything pc is loaded from the game data with has to land inside the code */
+static uint8_t *jump(uint8_t *p)
+{
+  if (p < pcbase || game_past(p + 1))
+    error("BADJ");
+  return p;
+}
+
 static uint8_t *address(void)
 {
   if (opcode & 0x20) {
     int8_t s = (int8_t)getb(pc++);
-    return pc + s - 1;
+    return jump(pc + s - 1);
+  }
+  pc += 2;
+  return jump(pcbase + getb(pc-2) + (getb(pc-1) << 8));
+} 
+
+static void skipaddress(void)
+{
+  if (!(opcode & 0x20))
+    pc++;
+  pc++;
+}
+
+/* List ops access a small fixed number of tables */
+static void listop(void)
+{
+  uint8_t t = (opcode & 0x1F) + 1;
+  uint8_t *base = tables[t];
+#ifdef VERIFY
+  /* Constant offsets into a verified table can't leave it */
+  if (lsafe[t] && !(opcode & 0x20)) {
+    base += getb(pc++);
+    if (!(opcode & 0x40)) {
+      if (ttype[t])
+        setvar(getb(pc++), *base);
+      else
+        setvar(getb(pc++), getb(base));
+    } else {
+      if (ttype[t] == 0)
+        error("WFLT");
+      poke(base, variables[getb(pc++)]);
+    }
+    return;
+  }
+#endif
+  if (base == NULL)
+    error("BADL");
+  if (opcode & 0x20)
+    base += variables[getb(pc++)];
+  else
+    base += getb(pc++);
+  if ((base >= game_base && base < game_base + gamesize) ||
+      (base >= lists && base < lists + sizeof(lists))) {
+    if (!(opcode & 0x40)) {
+      if (ttype[t])
+        setvar(getb(pc++), *base);
+      else
+        setvar(getb(pc++), getb(base));
+    } else { 
+      if (ttype[t] == 0)
+        error("WFLT");
+      poke(base, variables[getb(pc++)]);
+    }
+  } else {
+    error("LFLT");
+  }
+}  
+
+#ifdef VERIFY
+/*
+ *	Load time verifier. Walk every routine reachable from the start of
+ *	the code noting the largest constant offset each list op uses and
+ *	which routines call which. If every path could be followed then
+ *	list tables whose largest offset is in range need no bounds check,
+ *	and if the call graph has no loops and fits the stack then calls
+ *	and returns need no stack checks.
+ *
+ *	Anything we can't follow (jump tables, wild addresses, a return
+ *	from the top level, a stack reset inside a routine) leaves the
+ *	checks in place. Variable list offsets are always checked.
+ */
+
+#define MAX_ROUTINES	512
+#define MAX_CALLS	2048
+#define MAX_WORK	1024
+
+static uint8_t vseen[8192];
+static uint16_t vwork[MAX_WORK];
+static uint16_t ventry[MAX_ROUTINES];
+static uint8_t vstate[MAX_ROUTINES];
+static uint16_t vdepth[MAX_ROUTINES];
+static uint16_t vfrom[MAX_CALLS];
+static uint16_t vto[MAX_CALLS];
+static uint16_t nroutines;
+static uint16_t ncalls;
+static uint16_t codelen;
+static uint8_t maxoff[33];
+
+/* Code bytes, reading nothing past the end */
+static uint8_t vbyte(uint16_t a)
+{
+  if (a >= codelen)
+    return 0;
+  return getb(pcbase + a);
+}
+
+static uint8_t vtarget(uint8_t op, uint16_t a, uint16_t *t)
+{
+  int32_t v;
+  if (op & 0x20)
+    v = (int32_t)a + (int8_t)vbyte(a);
+  else
+    v = vbyte(a) | (vbyte(a + 1) << 8);
+  if (v < 0 || v >= codelen)
+    return 0;
+  *t = v;
+  return 1;
+}
+
+static uint8_t vcall(uint16_t from, uint16_t to)
+{
+  uint16_t i;
+  for (i = 0; i < nroutines; i++)
+    if (ventry[i] == to)
+      break;
+  if (i == nroutines) {
+    if (nroutines == MAX_ROUTINES)
+      return 0;
+    ventry[nroutines++] = to;
+  }
+  if (ncalls == MAX_CALLS)
+    return 0;
+  vfrom[ncalls] = from;
+  vto[ncalls++] = i;
+  return 1;
+}
+
+/* Walk one routine. Calls are assumed to come back */
+static uint8_t vwalk(uint16_t r)
+{
+  uint16_t sp = 0;
+  uint16_t a, t;
+  uint8_t op, alen, clen;
+
+  memset(vseen, 0, (codelen + 7) >> 3);
+  vwork[sp++] = ventry[r];
+  while(sp) {
+    a = vwork[--sp];
+    if (vseen[a >> 3] & (1 << (a & 7)))
+      continue;
+    vseen[a >> 3] |= 1 << (a & 7);
+    /* Running off the end, or out of room for two more successors */
+    if (a >= codelen || sp + 2 > MAX_WORK)
+      return 0;
+    op = vbyte(a);
+    alen = (op & 0x20) ? 1 : 2;
+    clen = (op & 0x40) ? 1 : 2;
+    if (op & 0x80) {
+      t = (op & 0x1F) + 1;
+      if (!(op & 0x20) && vbyte(a + 1) > maxoff[t])
+        maxoff[t] = vbyte(a + 1);
+      vwork[sp++] = a + 3;
+      continue;
+    }
+    switch(op & 0x1F) {
+      case 0:
+        if (!vtarget(op, a + 1, &t))
+          return 0;
+        vwork[sp++] = t;
+        break;
+      case 1:
+        if (!vtarget(op, a + 1, &t) || !vcall(r, t))
+          return 0;
+        vwork[sp++] = a + 1 + alen;
+        break;
+      case 2:
+        /* Returning from the top level would underflow */
+        if (r == 0)
+          return 0;
+        break;
+      case 3:
+      case 4:
+      case 20:
+      case 21:
+      case 22:
+        vwork[sp++] = a + 2;
+        break;
+      case 5:
+        vwork[sp++] = a + 1 + clen;
+        break;
+      case 6:
+        switch(vbyte(a + 1)) {
+          case 1:
+            break;
+          case 2:
+            vwork[sp++] = a + 3;
+            break;
+          case 6:
+            /* Throws the stack away under a routine's feet */
+            if (r)
+              return 0;
+            /* Fall through */
+          case 3:
+          case 4:
+          case 5:
+            vwork[sp++] = a + 2;
+            break;
+        }
+        break;
+      case 7:
+      case 15:
+        vwork[sp++] = a + 5;
+        break;
+      case 8:
+        vwork[sp++] = a + 2 + clen;
+        break;
+      case 9:
+      case 10:
+      case 11:
+        vwork[sp++] = a + 3;
+        break;
+      case 16:
+      case 17:
+      case 18:
+      case 19:
+        if (!vtarget(op, a + 3, &t))
+          return 0;
+        vwork[sp++] = t;
+        vwork[sp++] = a + 3 + alen;
+        break;
+      case 24:
+      case 25:
+      case 26:
+      case 27:
+        if (!vtarget(op, a + 2 + clen, &t))
+          return 0;
+        vwork[sp++] = t;
+        vwork[sp++] = a + 2 + clen + alen;
+        break;
+      case 14:
+        /* Jump tables go wherever the variable says */
+        return 0;
+      default:
+        /* Bad ops stop the game so the path ends */
+        break;
+    }
   }
-  pc += 2;
-  return pcbase + getb(pc-2) + (getb(pc-1) << 8);
-} 
+  return 1;
+}
 
-static void skipaddress(void)
+/* Stack entries used by the calls made from routine r */
+static int16_t vcalldepth(uint16_t r)
 {
-  if (!(opcode & 0x20))
-    pc++;
-  pc++;
+  uint16_t i;
+  int16_t d = 0, c;
+
+  if (vstate[r] == 1)
+    return -1;		/* Recursion */
+  if (vstate[r] == 2)
+    return vdepth[r];
+  vstate[r] = 1;
+  for (i = 0; i < ncalls; i++) {
+    if (vfrom[i] != r)
+      continue;
+    c = vcalldepth(vto[i]);
+    if (c < 0 || c >= STACKSIZE)
+      return -1;
+    if (c + 1 > d)
+      d = c + 1;
+  }
+  vstate[r] = 2;
+  vdepth[r] = d;
+  return d;
 }
 
-/* List ops access a small fixed number of tables */
-static void listop(void)
+static void verify(void)
 {
-  uint8_t t = (opcode & 0x1F) + 1;
-  uint8_t *base = tables[t];
-  if (base == NULL)
-    error("BADL");
-  if (opcode & 0x20)
-    base += variables[getb(pc++)];
-  else
-    base += getb(pc++);
-  if ((base >= game_base && base < game_base + gamesize) ||
-      (base >= lists && base < lists + sizeof(lists))) {
-    if (!(opcode & 0x40)) {
-      if (ttype[t])
-        variables[getb(pc++)] = *base;
-      else
-        variables[getb(pc++)] = getb(base);
-    } else { 
-      if (ttype[t] == 0)
-        error("WFLT");
-      *base = variables[getb(pc++)];
-    }
-  } else {
-    error("LFLT");
+  uint16_t r;
+  uint8_t t;
+  uint8_t done = 1;
+  uint8_t *b;
+
+  codelen = game_base + gamesize - pcbase;
+  if (game_base + gamesize <= pcbase || codelen > 8 * sizeof(vseen))
+    return;
+  ventry[0] = 0;
+  nroutines = 1;
+  for (r = 0; r < nroutines && done; r++)
+    done = vwalk(r);
+  if (done)
+    stack_ok = vcalldepth(0) >= 0;
+  for (t = 1; t < 33; t++) {
+    b = tables[t];
+    /* If we couldn't see all the code then any constant could be used */
+    if (!done)
+      maxoff[t] = 255;
+    if (b == NULL)
+      continue;
+    if (ttype[t])
+      lsafe[t] = b + maxoff[t] < lists + sizeof(lists);
+    else
+      lsafe[t] = b >= game_base && b + maxoff[t] < game_base + gamesize;
   }
-}  
+}
+#endif
 
 static void execute(void)
 {
@@ -620,6 +2137,11 @@ static void execute(void)
   
 
   while(!game_over) {
+#ifdef FUZZ
+    if (fuzz_budget-- == 0)
+      return;
+#endif
+    STAT(insns);
     opcode = getb(pc++);
     if (opcode & 0x80)
       listop();
@@ -629,16 +2151,22 @@ static void execute(void)
         break;
       case 1: {
           uint8_t *newpc = address();
-          if (stack == stackbase + sizeof(stackbase))
+#ifdef VERIFY
+          if (!stack_ok)
+#endif
+          if (stack == stackbase + STACKSIZE)
             error("stack overflow");
           *stack++ = pc - pcbase;
           pc = newpc;
         }
         break;
       case 2:
+#ifdef VERIFY
+        if (!stack_ok)
+#endif
         if (stack == stackbase)
           error("stack underflow");
-        pc = pcbase + *--stack;
+        pc = jump(pcbase + *--stack);
         break;
       case 3:
         print_num(variables[getb(pc++)]);
@@ -658,7 +2186,7 @@ static void execute(void)
           case 2:
             /* Emulate the random number algorithm in the original */
             seed = (((seed << 8) + 0x0A - seed) << 2) + seed + 1;
-            variables[getb(pc++)] = seed & 0xff;
+            setvar(getb(pc++), seed & 0xff);
             break;
           case 3:
             save_game();
@@ -667,7 +2195,12 @@ static void execute(void)
             load_game();
             break;
           case 5:
+#ifdef STATE_HASH
+            for (tmp16 = 0; tmp16 < 256; tmp16++)
+              setvar(tmp16, 0);
+#else
             memset(variables, 0, sizeof(variables));
+#endif
             break;
           case 6:
             stack = stackbase;
@@ -682,38 +2215,41 @@ static void execute(void)
         break;
       case 8:
         tmp16 = constant();
-        variables[getb(pc++)] = tmp16;
+        setvar(getb(pc++), tmp16);
         break;
       case 9:
-        variables[getb(pc + 1)] = variables[getb(pc)];
+        setvar(getb(pc + 1), variables[getb(pc)]);
         pc += 2;
         break;
       case 10:
-        variables[getb(pc + 1)] += variables[getb(pc)];
+        setvar(getb(pc + 1), variables[getb(pc + 1)] + variables[getb(pc)]);
         pc += 2;
         break;
       case 11:
-        variables[getb(pc + 1)] -= variables[getb(pc)];
+        setvar(getb(pc + 1), variables[getb(pc + 1)] - variables[getb(pc)]);
         pc += 2;
         break;
       case 14: /* This looks weird, but its basically a jump table */
         base = pcbase + (getb(pc) + (getb(pc + 1) << 8));
         base += 2 * variables[getb(pc + 2)];	/* 16bit entries * */
-        pc = pcbase + getb(base) + (getb(base + 1) << 8);
+        jump(base + 1);
+        pc = jump(pcbase + getb(base) + (getb(base + 1) << 8));
         break;
       case 15:
         lookup_exit();
         break;
       case 16:
-        /* These two are defined despite gcc whining. It doesn't matter
-           which way around they get evaluated */
-        if (variables[getb(pc++)] == variables[getb(pc++)])
+        /* Fetch the operands in order, the compiler is free to evaluate
+           the two sides of a comparison either way around */
+        tmp16 = variables[getb(pc++)];
+        if (tmp16 == variables[getb(pc++)])
           pc = address();
         else
           skipaddress();
         break;
       case 17:
-        if (variables[getb(pc++)] != variables[getb(pc++)])
+        tmp16 = variables[getb(pc++)];
+        if (tmp16 != variables[getb(pc++)])
           pc = address();
         else
           skipaddress();
@@ -733,39 +2269,55 @@ static void execute(void)
           skipaddress();
         break;
       case 24:
-        if (variables[getb(pc++)] == constant())
+        tmp16 = variables[getb(pc++)];
+        if (tmp16 == constant())
           pc = address();
         else
           skipaddress();
         break;
       case 25:
-        if (variables[getb(pc++)] != constant())
+        tmp16 = variables[getb(pc++)];
+        if (tmp16 != constant())
           pc = address();
         else
           skipaddress();
         break;
       case 26:
-        if (variables[getb(pc++)] < constant())
+        tmp16 = variables[getb(pc++)];
+        if (tmp16 < constant())
           pc = address();
         else
           skipaddress();
         break;
       case 27:
-        if (variables[getb(pc++)] > constant())
+        tmp16 = variables[getb(pc++)];
+        if (tmp16 > constant())
           pc = address();
         else
           skipaddress();
         break;
+      case 20:
+        /* graphics mode */
+        tmp = getb(pc++);
+#ifdef GRAPHICS
+        gfx_screen(tmp);
+#endif
+        break;
       case 21:
-        /* clear screen */
-        pc++;	/* value indicates screen to clear */
+        /* clear screen, non zero for the graphics screen */
+        tmp = getb(pc++);
+#ifdef GRAPHICS
+        if (tmp)
+          gfx_draw(GFX_CLEAR, 0);
+#endif
         break;
       case 22:
         /* picture */
-        pc++;
+        tmp16 = variables[getb(pc++)];
+#ifdef GRAPHICS
+        gfx_draw(GFX_PICTURE, tmp16);
+#endif
         break;
-      case 20:
-        /* graphics mode */
       case 23:
         /* getnextobject */
       case 28:
@@ -778,35 +2330,525 @@ static void execute(void)
 }
 
 
-int main(int argc, char *argv[])
+static int open_log(const char *name, int flags)
 {
-  uint8_t off = 4;
-  int i;
-  
-  if (argc == 1)
-    error("l9x [game.dat]\n");
+  int fd = open(name, flags, 0600);
+  if (fd == -1) {
+    perror(name);
+    exit(1);
+  }
+  return fd;
+}
+
+#ifndef VIRTUAL_GAME
+/* Where does the table starting at p end ? The header doesn't say so
+   assume it runs up to whatever starts next */
+static uint8_t *section_end(uint8_t *p)
+{
+  uint8_t *e = game + gamesize;
+  uint8_t *t[14];
+  uint8_t i;
+
+  for (i = 0; i < 12; i++)
+    t[i] = ttype[i] ? NULL : tables[i];
+  t[12] = messages;
+  t[13] = worddict - 1;
+  for (i = 0; i < 14; i++)
+    if (t[i] > p && t[i] < e)
+      e = t[i];
+  return e;
+}
+
+/* Record the start of each message between p and e */
+static uint16_t index_text(uint16_t *idx, uint8_t *p, uint8_t *e, uint8_t v1,
+                           uint16_t max)
+{
+  uint16_t n = 0;
+  uint16_t l;
+
+  while(p < e && n < max) {
+    idx[n++] = p - game;
+    if (v1) {
+      while(p < e && *p++ != 1);
+    } else {
+      l = 0;
+      while(p < e && *p == 0) {
+        l += 255;
+        p++;
+      }
+      if (p == e)
+        break;
+      p += l + *p;
+    }
+  }
+  return n;
+}
+
+/*
+ *	Write out every message in one pass over the table, one per line as
+ *	number: text with newlines and backslashes escaped. The word
+ *	dictionary is indexed first so expanding a word doesn't mean walking
+ *	the dictionary again each time.
+ */
+
+static char *dumpname;
+static char dbuf[512];
+static uint16_t dlen;
+
+static void dump_flush(void)
+{
+  if (write(dumpfd, dbuf, dlen) != dlen)
+    error("l9x: dump write failed\n");
+  dlen = 0;
+}
+
+static void dump_str(const char *p)
+{
+  while(*p) {
+    if (dlen == sizeof(dbuf))
+      dump_flush();
+    dbuf[dlen++] = *p++;
+  }
+}
+
+static void dump_char(char c)
+{
+  char s[2];
+  if (c == '\n')
+    dump_str("\\n");
+  else if (c == '\\')
+    dump_str("\\\\");
+  else {
+    s[0] = c;
+    s[1] = 0;
+    dump_str(s);
+  }
+}
+
+static void dump_messages(const char *name)
+{
+  static uint16_t idx[0xA2];
+  uint8_t *p = messages;
+  uint8_t *e = section_end(messages);
+  uint16_t m = FIRST_MSG;
+
+  if (strcmp(name, "-") == 0)
+    dumpfd = 1;
+  else
+    dumpfd = open_log(name, O_WRONLY|O_TRUNC|O_CREAT);
+  /* An image already has one */
+  if (dictidx == NULL) {
+    ndict = index_text(idx, worddict_base, section_end(worddict_base),
+                       TEXT_V1, 0xA2);
+    dictidx = idx;
+  }
+  while(p < e) {
+    dump_str(numstr(m++));
+    dump_str(": ");
+    msgout(p);
+    dump_str("\n");
+    p = msgnext(p);
+  }
+  dump_flush();
+}
+#endif
+
+#ifdef GAME_IMAGE
+/*
+ *	Preprocessed game images. l9x -c writes out the game along with
+ *	the message, word dictionary, input dictionary and exit indexes so
+ *	that running from the image is just an mmap. The image is in host
+ *	byte order (the version field catches a mismatch) and is only ever
+ *	mapped read only so every session on the box shares the one copy.
+ */
+
+#define IMAGE_MAGIC	"L9XI"
+#define IMAGE_VERSION	1
+#define IMAGE_TEXTV1	1	/* Messages use the 1 terminated format */
+
+struct image {
+  char magic[4];
+  uint16_t version;
+  uint16_t flags;
+  uint16_t gamesize;
+  uint16_t nmsg;
+  uint16_t ndict;
+  uint16_t nword;
+  uint16_t nloc;
+  uint16_t pad;
+  uint32_t o_game;
+  uint32_t o_msg;	/* nmsg offsets of each message */
+  uint32_t o_dict;	/* ndict offsets of each word dictionary entry */
+  uint32_t o_word;	/* nword input words, grouped by first letter */
+  uint32_t o_wordstart;	/* 129 entries, start of each letter in o_word */
+  uint32_t o_exit;	/* nloc + 1 offsets of each location's exits */
+};
+
+static char *imagename;
+
+/* Sizes are added wide so an offset near 4G can't wrap back into range */
+static uint8_t image_fits(uint32_t o, uint32_t n, off_t size)
+{
+  return (uint64_t)o + n <= (uint64_t)size;
+}
+
+/* Index tables are read as uint16_t so have to be aligned for it */
+static uint8_t image_table(uint32_t o, uint32_t n, off_t size)
+{
+  return !(o & 1) && image_fits(o, 2 * n, size);
+}
+
+static void image_map(void)
+{
+  struct stat st;
+  struct image *h;
+  uint8_t *m;
+  uint32_t i;
+
+  if (fstat(gamefile, &st) == -1 || st.st_size < sizeof(struct image))
+    error("l9x: bad image\n");
+  m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, gamefile, 0);
+  if (m == MAP_FAILED)
+    error("mmap");
+  h = (struct image *)m;
+  if (h->version != IMAGE_VERSION)
+    error("l9x: wrong image version\n");
+#ifdef TEXT_VERSION1
+  if (!(h->flags & IMAGE_TEXTV1))
+    error("l9x: image has version 2 text, use l9x\n");
+#else
+  if (h->flags & IMAGE_TEXTV1)
+    error("l9x: image has version 1 text, use l9x-1\n");
+#endif
+  /* Trust the layout but not the contents */
+  if (!image_fits(h->o_game, h->gamesize, st.st_size) ||
+      !image_table(h->o_msg, h->nmsg, st.st_size) ||
+      !image_table(h->o_dict, h->ndict, st.st_size) ||
+      !image_table(h->o_word, h->nword, st.st_size) ||
+      !image_table(h->o_wordstart, 129, st.st_size) ||
+      !image_table(h->o_exit, h->nloc + 1, st.st_size) || h->gamesize < 32)
+    error("l9x: bad image\n");
+  game = m + h->o_game;
+  gamesize = h->gamesize;
+  msgidx = (uint16_t *)(m + h->o_msg);
+  dictidx = (uint16_t *)(m + h->o_dict);
+  wordidx = (uint16_t *)(m + h->o_word);
+  wordstart = (uint16_t *)(m + h->o_wordstart);
+  exitidx = (uint16_t *)(m + h->o_exit);
+  for (i = 0; i < h->nmsg; i++)
+    if (msgidx[i] >= gamesize)
+      error("l9x: bad image\n");
+  for (i = 0; i < h->ndict; i++)
+    if (dictidx[i] >= gamesize)
+      error("l9x: bad image\n");
+  for (i = 0; i < h->nword; i++)
+    if (wordidx[i] >= gamesize)
+      error("l9x: bad image\n");
+  for (i = 0; i < 129; i++)
+    if (wordstart[i] > h->nword || (i && wordstart[i] < wordstart[i - 1]))
+      error("l9x: bad image\n");
+  for (i = 1; i <= h->nloc; i++)
+    if (exitidx[i] >= gamesize)
+      error("l9x: bad image\n");
+  nmsg = h->nmsg;
+  ndict = h->ndict;
+  nword = h->nword;
+  nloc = h->nloc;
+}
+
+/* Version 1 text is 1 terminated, version 2 is length prefixed. Walking
+   version 1 text by lengths soon lands on a terminator byte inside a
+   message, which version 2 text never contains */
+static uint8_t text_is_v1(uint8_t *p, uint8_t *e)
+{
+  uint8_t n = 32;
+  uint16_t l;
+
+  while(n-- && p < e) {
+    l = 0;
+    while(p < e && *p == 0) {
+      l += 255;
+      p++;
+    }
+    if (p == e)
+      return 1;
+    l += *p++;
+    while(--l) {
+      if (p == e || *p++ < 3)
+        return 1;
+    }
+  }
+  return 0;
+}
+
+static uint16_t index_exits(uint16_t *idx)
+{
+  uint8_t *p = exitmap;
+  uint8_t *e = game + gamesize;
+  uint16_t n = 0;
+
+  /* Location 1 onwards, up to the 0 end marker */
+  while(n < 255 && p < e && *p) {
+    idx[++n] = p - game;
+    do {
+      p += 2;
+    } while(p < e && !(p[-2] & 0x80));
+  }
+  return n;
+}
+
+static uint16_t index_words(uint16_t *idx, uint16_t *start)
+{
+  uint8_t *e = section_end(dictionary);
+  uint8_t *p;
+  uint16_t n = 0;
+  int c;
+
+  /* Bucket the words by first letter, keeping dictionary order within
+     each bucket as matchword() takes the first hit */
+  for (c = 0; c < 128; c++) {
+    start[c] = n;
+    p = dictionary;
+    do {
+      if ((*p & 0x7F) == c)
+        idx[n++] = p - game;
+      while(p < e && *p && !(*p & 0x80))
+        p++;
+      p += 2;
+    } while(p < e && !(*p & 0x80));
+  }
+  start[128] = n;
+  return n;
+}
+
+static void image_put(int fd, void *p, uint32_t len, uint32_t *off)
+{
+  static const uint8_t zero[4];
+  if (off)
+    *off = lseek(fd, 0, SEEK_CUR);
+  if (write(fd, p, len) != len ||
+      write(fd, zero, (4 - (len & 3)) & 3) < 0)
+    error("l9x: image write failed\n");
+}
+
+static void image_build(int fd)
+{
+  struct image h;
+  uint16_t *msg = malloc(2 * (gamesize + 1));
+  uint16_t *dict = malloc(2 * 0xA2);
+  uint16_t *word = malloc(2 * (gamesize + 1));
+  uint16_t start[129];
+  uint16_t exits[256];
+  uint8_t *me = section_end(messages);
+
+  if (msg == NULL || dict == NULL || word == NULL)
+    error("l9x: out of memory\n");
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, IMAGE_MAGIC, 4);
+  h.version = IMAGE_VERSION;
+  h.gamesize = gamesize;
+  if (text_is_v1(messages, me)) {
+    h.flags |= IMAGE_TEXTV1;
+    h.nmsg = index_text(msg, messages, me, 1, gamesize);
+    h.ndict = index_text(dict, worddict, section_end(worddict), 1, 0xA2);
+  } else {
+    /* Message 0 is always empty */
+    msg[0] = 0;
+    h.nmsg = index_text(msg + 1, messages, me, 0, gamesize) + 1;
+    h.ndict = index_text(dict, worddict - 1, section_end(worddict - 1), 0,
+                         0xA2);
+  }
+  h.nword = index_words(word, start);
+  exits[0] = 0;
+  h.nloc = index_exits(exits);
+
+  image_put(fd, &h, sizeof(h), NULL);
+  image_put(fd, game, gamesize, &h.o_game);
+  image_put(fd, msg, 2 * h.nmsg, &h.o_msg);
+  image_put(fd, dict, 2 * h.ndict, &h.o_dict);
+  image_put(fd, word, 2 * h.nword, &h.o_word);
+  image_put(fd, start, sizeof(start), &h.o_wordstart);
+  image_put(fd, exits, 2 * (h.nloc + 1), &h.o_exit);
+  /* And now we know where it all went */
+  if (lseek(fd, 0, SEEK_SET) != 0 || write(fd, &h, sizeof(h)) != sizeof(h))
+    error("l9x: image write failed\n");
+  free(msg);
+  free(dict);
+  free(word);
+}
+
+static void image_write(const char *name)
+{
+  int fd = open(name, O_WRONLY|O_TRUNC|O_CREAT, 0644);
+  if (fd == -1) {
+    perror(name);
+    exit(1);
+  }
+  image_build(fd);
+  close(fd);
+}
+
+/*
+ *	Launcher. l9x -L socket loads the game once, turns it into an image
+ *	in a sealed memfd unless it already is one, and maps that. Then it
+ *	forks a session for each connection to the socket. The image and
+ *	the verifier's results are shared, so a session only has its own
+ *	context and buffers and starts without touching the disc.
+ */
+
+static char *sockname;
+
+static void game_setup(void);
+
+static void image_share(void)
+{
+  int fd;
+#ifdef MFD_ALLOW_SEALING
+  fd = memfd_create("l9x", MFD_CLOEXEC|MFD_ALLOW_SEALING);
+#else
+  /* No memfd, an unlinked file mapped read only will do */
+  char name[] = "/tmp/l9xXXXXXX";
+  fd = mkstemp(name);
+  if (fd != -1)
+    unlink(name);
+#endif
+  if (fd == -1)
+    error("memfd");
+  image_build(fd);
+#ifdef F_ADD_SEALS
+  if (fcntl(fd, F_ADD_SEALS,
+      F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_WRITE|F_SEAL_SEAL) == -1)
+    error("seal");
+#endif
+  gamefile = fd;
+  image_map();
+  close(fd);
+  game_setup();
+}
+
+/* Only returns in a session, with the connection as stdin and stdout */
+static void launch(void)
+{
+  struct sockaddr_un sa;
+  int ls, fd;
+
+  if (strlen(sockname) >= sizeof(sa.sun_path))
+    error("l9x: socket name too long\n");
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  strcpy(sa.sun_path, sockname);
+  unlink(sockname);
+  ls = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (ls == -1 || bind(ls, (struct sockaddr *)&sa, sizeof(sa)) == -1 ||
+      listen(ls, 16) == -1) {
+    perror(sockname);
+    exit(1);
+  }
+  /* Nobody waits for the sessions */
+  signal(SIGCHLD, SIG_IGN);
+  while (1) {
+    fd = accept(ls, NULL, NULL);
+    if (fd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      error("accept");
+    }
+    switch(fork()) {
+      case 0:
+        signal(SIGCHLD, SIG_DFL);
+        close(ls);
+        dup2(fd, 0);
+        dup2(fd, 1);
+        close(fd);
+        return;
+      case -1:
+        perror("fork");
+    }
+    close(fd);
+  }
+}
+
+#endif
+
+#ifdef GAME_IMAGE
+#define USAGE_IMAGE	" [-c image] [-L socket]"
+#else
+#define USAGE_IMAGE	""
+#endif
+#ifndef VIRTUAL_GAME
+#define USAGE_DUMP	" [-d file]"
+#else
+#define USAGE_DUMP	""
+#endif
+#ifdef SNAPSHOT
+#define USAGE_SNAP	" [-S dir]"
+#else
+#define USAGE_SNAP	""
+#endif
+#ifdef GRAPHICS
+#define USAGE_GFX	" [-g pictures]"
+#else
+#define USAGE_GFX	""
+#endif
+#ifdef METRICS
+#define USAGE_STATS	" [-s file]"
+#else
+#define USAGE_STATS	""
+#endif
+#ifdef MSG_CACHE
+#define USAGE_MCACHE	" [-m size]"
+#else
+#define USAGE_MCACHE	""
+#endif
+#define USAGE	"l9x" USAGE_IMAGE USAGE_DUMP USAGE_GFX " [-l log]" USAGE_MCACHE " [-r log]" USAGE_SNAP USAGE_STATS " [game.dat]\n"
 
-  gamefile = open(argv[1], O_RDONLY);
+static void game_open(const char *name)
+{
+  gamefile = open(name, O_RDONLY);
   if (gamefile == -1) {
-    perror(argv[1]);
+    perror(name);
     exit(1);
   }
   /* FIXME: allocate via sbrk once removed stdio usage */
-  if ((gamesize = read(gamefile, game, sizeof(game))) < 32)
+  if ((gamesize = read(gamefile, game_data, sizeof(game_data))) < 32)
     error("l9x: not a valid game\n");
 #ifdef VIRTUAL_GAME
   gamesize = 0xff00;
   memset(page_addr, 0xff, sizeof(page_addr));
 #else
+#ifdef GAME_IMAGE
+  if (memcmp(game, IMAGE_MAGIC, 4) == 0) {
+    if (imagename)
+      error("l9x: already an image\n");
+    image_map();
+  }
+#endif
   close(gamefile);
 #endif
+}
+
+static void game_setup(void)
+{
+  uint8_t off = 4;
+  int i;
 
   /* Header starts with message and decompression dictionary */
   messages = game_base + (game[0] | (game[1] << 8));
   worddict = game_base + (game[2] | (game[3] << 8));
+#ifndef VIRTUAL_GAME
+  /* The dictionary is read from one byte before where the header says */
+  if (messages >= game_base + gamesize || worddict >= game_base + gamesize ||
+      worddict == game_base)
+    error("l9x: not a valid game\n");
+#endif
   /* Then the tables for list ops */
   for (i = 0; i  < 12; i++) {
     uint16_t v = game[off] | (game[off + 1] << 8);
+#ifndef VIRTUAL_GAME
+    /* The ones used directly must be in the game, listop checks the rest */
+    if ((i < 2 || i == 11) && v >= gamesize)
+      error("l9x: not a valid game\n");
+#endif
     if (i != 11 && (v & 0x8000)) {
       tables[i] = lists + (v & 0x7FFF);
       ttype[i] = 1;
@@ -820,14 +2862,169 @@ int main(int argc, char *argv[])
   pcbase = pc = tables[11];
   /* 3 and 4 are used for getnextobject and friends on later games,
      9 is used for driver magic and ramsave stuff */
+#ifdef MSG_CACHE
+  mcache_flush();
+#endif
+}
+
+/* Are we replaying the file we log to */
+static uint8_t same_log(void)
+{
+  struct stat l, r;
+  if (replayfd == -1 || fstat(logfd, &l) == -1 || fstat(replayfd, &r) == -1)
+    return 0;
+  return l.st_dev == r.st_dev && l.st_ino == r.st_ino;
+}
+
+static void replay_start(void)
+{
+  if (replay_fill()) {
+    if (*rbuf == '#') {
+      replay_line();
+      seed = atoi(buffer + 1);
+    }
+    /* Run silently up to the last logged line */
+    if (replayfd != -1)
+      quiet = 1;
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  int i;
+#ifdef METRICS
+  const char *statsname = NULL;
+#endif
+  
+  while ((i = getopt(argc, argv, "c:d:g:l:L:m:r:s:S:")) != -1) {
+    switch(i) {
+#ifdef GAME_IMAGE
+      case 'c':
+        imagename = optarg;
+        break;
+#endif
+#ifndef VIRTUAL_GAME
+      case 'd':
+        dumpname = optarg;
+        break;
+#endif
+#ifdef GAME_IMAGE
+      case 'L':
+        sockname = optarg;
+        break;
+#endif
+#ifdef GRAPHICS
+      case 'g':
+        picname = optarg;
+        break;
+#endif
+      case 'l':
+        logfd = open_log(optarg, O_WRONLY|O_APPEND|O_CREAT);
+        break;
+#ifdef MSG_CACHE
+      case 'm':
+        mcache_size = atoi(optarg);
+        break;
+#endif
+      case 'r':
+        replayfd = open_log(optarg, O_RDONLY);
+        break;
+#ifdef METRICS
+      case 's':
+        statsname = optarg;
+        break;
+#endif
+#ifdef SNAPSHOT
+      case 'S':
+        storedir = optarg;
+        break;
+#endif
+      default:
+        error(USAGE);
+    }
+  }
+  if (optind >= argc)
+    error(USAGE);
+
+  game_open(argv[optind]);
+  game_setup();
+
+#ifndef VIRTUAL_GAME
+  if (dumpname) {
+    dump_messages(dumpname);
+    return 0;
+  }
+#endif
+#ifdef GAME_IMAGE
+  if (imagename) {
+    image_write(imagename);
+    return 0;
+  }
+  if (sockname) {
+    /* Sessions can't share one log, replay or set of counters */
+    if (logfd != -1 || replayfd != -1)
+      error(USAGE);
+#ifdef METRICS
+    if (statsname)
+      error(USAGE);
+#endif
+    if (msgidx == NULL)
+      image_share();
+  }
+#endif
+
+#ifdef VERIFY
+  verify();
+#endif
+#ifdef GAME_IMAGE
+  if (sockname)
+    launch();
+#endif
   
   display_init();
+#ifdef MSG_CACHE
+  mcache_init();
+#endif
+#ifdef GRAPHICS
+  if (picname)
+    gfx_start();
+#endif
+#ifdef METRICS
+  metrics_start(statsname);
+#endif
   
-  seed = time(NULL);
+  seed = time(NULL) ^ getpid();
+
+  /* Turns added to a log have to follow on from the ones in it, which
+     only holds if the same log is being replayed first */
+  if (logfd != -1 && lseek(logfd, 0, SEEK_END) != 0 && !same_log())
+    error("l9x: log isn't empty, replay it with -r to carry on\n");
+  if (replayfd != -1)
+    replay_start();
+  /* A new log starts with the seed so it can be replayed */
+  if (logfd != -1 && lseek(logfd, 0, SEEK_END) == 0) {
+    write(logfd, "#", 1);
+    write(logfd, numstr(seed), strlen(numstr(seed)));
+    write(logfd, "\n", 1);
+  }
 
   execute();
+#ifdef GRAPHICS
+  gfx_stop();
+#endif
+#ifdef METRICS
+  if (statsfd != -1)
+    metrics_write(statsfd);
+#endif
 
 #ifdef STATISTICS
-  printf("Fast %d Slow %d Miss %d\n", fast, slow, miss);
+#ifdef VIRTUAL_GAME
+  printf("Fast %lu Slow %lu Miss %lu\n", fast, slow, miss);
+#endif
+  printf("Instructions %lu Turns %lu\n", insns, turns);
+#ifdef MSG_CACHE
+  printf("Message cache hits %lu misses %lu\n", mhits, mmisses);
+#endif
 #endif
+  return 0;
 }